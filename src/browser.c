@@ -32,6 +32,8 @@
 
 
 static int graph = 1, show_as = 0, info_show = 0, info_page = 0, info_start = 0, show_items = 0, show_mtime = 0;
+static int show_shared = 0; /* 1 = exclusive sizes, 2 = shared sizes */
+static int stats_show = 0, stats_page = 0;
 static const char *message = NULL;
 
 
@@ -40,9 +42,13 @@ static void browse_draw_info(struct dir *dr) {
   struct dir *t;
   struct dir_ext *e = dir_ext_ptr(dr);
   char mbuf[46];
-  int i;
+  int i, row = 8, end;
+  int64_t sh = getshared(dr, 0), ash = getshared(dr, 1);
 
-  nccreate(11, 60, "Item info");
+  /* row of the last line, below the optional ones */
+  end = 8 + (sh || ash ? 2 : 0) + (dr->flags & FF_EST ? 1 : 0);
+  end = end > 9 ? end : 9;
+  nccreate(end+2, 60, "Item info");
 
   if(dr->hlnk) {
     nctab(41, info_page == 0, 1, "Info");
@@ -90,6 +96,42 @@ static void browse_draw_info(struct dir *dr) {
     addstrc(UIC_DEFAULT, " (");
     addstrc(UIC_NUM, fullsize(dr->asize));
     addstrc(UIC_DEFAULT, " B)");
+
+    /* hard links that are also elsewhere in the tree */
+    if(sh || ash) {
+      attron(A_BOLD);
+      ncaddstr(row, 3, "    Exclusive:");
+      ncaddstr(row+1, 3, "       Shared:");
+      attroff(A_BOLD);
+      ncmove(row, 18);
+      printsize(UIC_DEFAULT, dr->size - sh);
+      addstrc(UIC_DEFAULT, ", ");
+      printsize(UIC_DEFAULT, dr->asize - ash);
+      addstrc(UIC_DEFAULT, " apparent");
+      ncmove(row+1, 18);
+      printsize(UIC_DEFAULT, sh);
+      addstrc(UIC_DEFAULT, ", ");
+      printsize(UIC_DEFAULT, ash);
+      addstrc(UIC_DEFAULT, " apparent");
+      row += 2;
+    }
+
+    if(dr->flags & FF_EST) {
+      attron(A_BOLD);
+      ncaddstr(row, 3, "     Estimate:");
+      attroff(A_BOLD);
+      if(!(dr->flags & FF_DIR))
+        ncaddstr(row, 18, "mean size of a sample of the directory");
+      else if(dir_mem_margin(dr, 0) || dir_mem_margin(dr, 1)) {
+        ncaddstr(row, 18, "+/- ");
+        printsize(UIC_DEFAULT, dir_mem_margin(dr, 0));
+        addstrc(UIC_DEFAULT, ", +/- ");
+        printsize(UIC_DEFAULT, dir_mem_margin(dr, 1));
+        addstrc(UIC_DEFAULT, " apparent");
+      } else
+        ncaddstr(row, 18, "includes estimated sizes");
+      row++;
+    }
     break;
 
   case 1:
@@ -105,21 +147,59 @@ static void browse_draw_info(struct dir *dr) {
     break;
   }
 
-  ncaddstr(9, 31, "Press ");
+  ncaddstr(end, 31, "Press ");
   addchc(UIC_KEY, 'i');
   addstrc(UIC_DEFAULT, " to hide this window");
 }
 
 
+static void browse_draw_stats(void) {
+  struct dir_scan_top *top = stats_page ? dir_scan_largest : dir_scan_slowest;
+  int i, n = stats_page ? dir_scan_nlargest : dir_scan_nslowest;
+  double ms;
+
+  nccreate(16, 70, "Scan statistics");
+  nctab(44, stats_page == 0, 1, "Slowest");
+  nctab(56, stats_page == 1, 2, "Largest");
+
+  if(!n)
+    ncaddstr(2, 3, dir_import_active ? "Not available for imported directories." : "No directories have been scanned.");
+  else {
+    attron(A_BOLD);
+    ncaddstr(2, 3, "    Time      Read   Items  Directory");
+    attroff(A_BOLD);
+  }
+  for(i=0; i<n; i++) {
+    ms = top[i].ns / 1e6;
+    ncprint(3+i, 3, ms < 10000 ? "%6.1f ms" : "%6.1f s ", ms < 10000 ? ms : ms/1000);
+    ms = top[i].read_ns / 1e6;
+    ncprint(3+i, 13, ms < 10000 ? "%6.1f ms" : "%6.1f s ", ms < 10000 ? ms : ms/1000);
+    ncprint(3+i, 23, "%7d", top[i].items);
+    ncaddstr(3+i, 32, cropstr(top[i].path, 35));
+  }
+
+  ncaddstr(14, 41, "Press ");
+  addchc(UIC_KEY, 'S');
+  addstrc(UIC_DEFAULT, " to hide this window");
+}
+
+
 static void browse_draw_flag(struct dir *n, int *x) {
+  /* still being scanned, when browsing the partial tree */
+  int scan = dir_browse && dir_mem_counting(n);
+
   addchc(n->flags & FF_BSEL ? UIC_FLAG_SEL : UIC_FLAG,
       n == dirlist_parent ? ' ' :
+                     scan ? '*' :
         n->flags & FF_EXL ? '<' :
         n->flags & FF_ERR ? '!' :
        n->flags & FF_SERR ? '.' :
       n->flags & FF_OTHFS ? '>' :
      n->flags & FF_KERNFS ? '^' :
      n->flags & FF_FRMLNK ? 'F' :
+     n->flags & FF_BNDMNT ? 'B' :
+       n->flags & FF_AGGR ? '+' :
+        n->flags & FF_EST ? '~' :
       n->flags & FF_HLNKC ? 'H' :
      !(n->flags & FF_FILE
     || n->flags & FF_DIR) ? '@' :
@@ -198,6 +278,22 @@ static void browse_draw_items(struct dir *n, int *x) {
 }
 
 
+static void browse_draw_shared(struct dir *n, int *x) {
+  enum ui_coltype c = n->flags & FF_BSEL ? UIC_SEL : UIC_DEFAULT;
+  int64_t sh;
+
+  if(!show_shared)
+    return;
+  *x += 11;
+  if(n == dirlist_parent)
+    return;
+
+  sh = getshared(n, show_as);
+  addchc(c, ' ');
+  printsize(c, show_shared == 2 ? sh : (show_as ? n->asize : n->size) - sh);
+}
+
+
 static void browse_draw_mtime(struct dir *n, int *x) {
   enum ui_coltype c = n->flags & FF_BSEL ? UIC_SEL : UIC_DEFAULT;
   char mbuf[26];
@@ -241,6 +337,9 @@ static void browse_draw_item(struct dir *n, int row) {
   browse_draw_graph(n, &x);
   move(row, x);
 
+  browse_draw_shared(n, &x);
+  move(row, x);
+
   browse_draw_items(n, &x);
   move(row, x);
 
@@ -251,7 +350,8 @@ static void browse_draw_item(struct dir *n, int row) {
 
   if(n->flags & FF_DIR)
     c = c == UIC_SEL ? UIC_DIR_SEL : UIC_DIR;
-  addchc(c, n->flags & FF_DIR ? '/' : ' ');
+  /* Roots under a virtual root already start with a slash */
+  addchc(c, n->flags & FF_DIR && !(n->parent && n->parent->flags & FF_VROOT) ? '/' : ' ');
   addstrc(c, cropstr(n->name, wincols-x-1));
 }
 
@@ -270,18 +370,30 @@ void browse_draw() {
   mvprintw(0,0,"%s %s ~ Use the arrow keys to navigate, press ", PACKAGE_NAME, PACKAGE_VERSION);
   addchc(UIC_KEY_HD, '?');
   addstrc(UIC_HD, " for help");
-  if(dir_import_active)
+  if(dir_browse)
+    mvaddstr(0, wincols-10, "[scanning]");
+  else if(dir_import_active)
     mvaddstr(0, wincols-10, "[imported]");
+#if USE_WATCH
+  else if(watch_stale)
+    mvaddstr(0, wincols-10, "[outdated]");
+#endif
   else if(read_only)
     mvaddstr(0, wincols-11, "[read-only]");
 
   /* second line - the path */
   mvhlinec(UIC_DEFAULT, 1, 0, '-', wincols);
+  i = show_shared ? wincols-20 : wincols-8;
   if(dirlist_par) {
     mvaddchc(UIC_DEFAULT, 1, 3, ' ');
     tmp = getpath(dirlist_par);
-    mvaddstrc(UIC_DIR, 1, 4, cropstr(tmp, wincols-8));
-    mvaddchc(UIC_DEFAULT, 1, 4+((int)strlen(tmp) > wincols-8 ? wincols-8 : (int)strlen(tmp)), ' ');
+    mvaddstrc(UIC_DIR, 1, 4, cropstr(tmp, i));
+    mvaddchc(UIC_DEFAULT, 1, 4+((int)strlen(tmp) > i ? i : (int)strlen(tmp)), ' ');
+  }
+  /* label of the column with exclusive or shared sizes */
+  if(show_shared) {
+    tmp = show_shared == 1 ? " exclusive " : " shared ";
+    mvaddstrc(UIC_DEFAULT, 1, wincols-3-(int)strlen(tmp), tmp);
   }
 
   /* bottom line - stats */
@@ -290,9 +402,17 @@ void browse_draw() {
   if(t) {
     mvaddstr(winrows-1, 0, " Total disk usage: ");
     printsize(UIC_HD, t->parent->size);
+    if(dir_mem_margin(t->parent, 0)) {
+      addstrc(UIC_HD, " +/- ");
+      printsize(UIC_HD, dir_mem_margin(t->parent, 0));
+    }
     addstrc(UIC_HD, "  Apparent size: ");
     uic_set(UIC_NUM_HD);
     printsize(UIC_HD, t->parent->asize);
+    if(dir_mem_margin(t->parent, 1)) {
+      addstrc(UIC_HD, " +/- ");
+      printsize(UIC_HD, dir_mem_margin(t->parent, 1));
+    }
     addstrc(UIC_HD, "  Items: ");
     uic_set(UIC_NUM_HD);
     printw("%d", t->parent->items);
@@ -326,12 +446,30 @@ void browse_draw() {
   t = dirlist_get(0);
   if(!message && info_show && t != dirlist_parent)
     browse_draw_info(t);
+  if(!message && stats_show)
+    browse_draw_stats();
 
   /* move cursor to selected row for accessibility */
   move(selected+2, 0);
 }
 
 
+/* Scans all roots under a virtual root again */
+static void refresh_roots(struct dir *vroot) {
+  struct dir *t;
+  char **paths;
+  int n = 0, i;
+
+  for(t=vroot->sub; t; t=t->next)
+    n++;
+  paths = xmalloc(n*sizeof(char *));
+  for(i=0, t=vroot->sub; t; t=t->next)
+    paths[i++] = t->name[0] ? t->name : "/";
+  dir_scan_init_roots(paths, n);
+  free(paths);
+}
+
+
 int browse_key(int ch) {
   struct dir *t, *sel;
   int i, catch = 0;
@@ -342,6 +480,31 @@ int browse_key(int ch) {
     return 0;
   }
 
+  /* The partial tree that is browsed during a scan can only be looked at */
+  if(dir_browse && (ch == 'd' || ch == 'r' || ch == '?')) {
+    message = "Not available while scanning.";
+    return 0;
+  }
+
+  /* statistics window overwrites all keys */
+  if(stats_show) {
+    switch(ch) {
+    case '1':
+    case KEY_LEFT:
+    case 'h':
+      stats_page = 0;
+      break;
+    case '2':
+    case KEY_RIGHT:
+    case 'l':
+      stats_page = 1;
+      break;
+    default:
+      stats_show = 0;
+    }
+    return 0;
+  }
+
   sel = dirlist_get(0);
 
   /* info window overwrites a few keys */
@@ -454,10 +617,19 @@ int browse_key(int ch) {
       dirlist_set_sort(DL_NOCHANGE, DL_NOCHANGE, !dirlist_sort_df);
       info_show = 0;
       break;
+    case 'U':
+      i = show_shared == 2 ? (show_as ? DL_COL_ASHARED : DL_COL_SHARED) : (show_as ? DL_COL_AEXCL : DL_COL_EXCL);
+      dirlist_set_sort(i, dirlist_sort_col == i ? !dirlist_sort_desc : 1, DL_NOCHANGE);
+      info_show = 0;
+      break;
     case 'a':
       show_as = !show_as;
       if(dirlist_sort_col == DL_COL_ASIZE || dirlist_sort_col == DL_COL_SIZE)
         dirlist_set_sort(show_as ? DL_COL_ASIZE : DL_COL_SIZE, DL_NOCHANGE, DL_NOCHANGE);
+      else if(dirlist_sort_col == DL_COL_AEXCL || dirlist_sort_col == DL_COL_EXCL)
+        dirlist_set_sort(show_as ? DL_COL_AEXCL : DL_COL_EXCL, DL_NOCHANGE, DL_NOCHANGE);
+      else if(dirlist_sort_col == DL_COL_ASHARED || dirlist_sort_col == DL_COL_SHARED)
+        dirlist_set_sort(show_as ? DL_COL_ASHARED : DL_COL_SHARED, DL_NOCHANGE, DL_NOCHANGE);
       info_show = 0;
       break;
 
@@ -465,11 +637,23 @@ int browse_key(int ch) {
     case 10:
     case KEY_RIGHT:
     case 'l':
-      if(sel != NULL && sel->flags & FF_DIR) {
+      info_show = 0;
+      /* The contents of a directory below --max-depth are scanned when it is
+       * entered, to the same depth again */
+      if(sel != NULL && sel != dirlist_parent && sel->flags & FF_AGGR) {
+        if(dir_import_active)
+          message = "Directory contents not imported, use a larger --max-depth.";
+        else if(dir_browse)
+          message = "Not available while scanning.";
+        else {
+          dir_ui = 2;
+          dir_mem_init(sel);
+          dir_scan_init(getpath(sel));
+        }
+      } else if(sel != NULL && sel->flags & FF_DIR) {
         dirlist_open(sel == dirlist_parent ? dirlist_par->parent : sel);
         dirlist_top(-3);
       }
-      info_show = 0;
       break;
     case KEY_LEFT:
     case KEY_BACKSPACE:
@@ -488,7 +672,11 @@ int browse_key(int ch) {
         message = "Directory imported from file, won't refresh.";
         break;
       }
-      if(dirlist_par) {
+      if(dirlist_par && dirlist_par->flags & FF_VROOT) {
+        dir_ui = 2;
+        dir_mem_init(dirlist_par);
+        refresh_roots(dirlist_par);
+      } else if(dirlist_par) {
         dir_ui = 2;
         dir_mem_init(dirlist_par);
         dir_scan_init(getpath(dirlist_par));
@@ -511,6 +699,12 @@ int browse_key(int ch) {
     case 'c':
       show_items = !show_items;
       break;
+    case 'u':
+      show_shared = (show_shared + 1) % 3;
+      /* keep sorting by the column that is shown */
+      if(show_shared && dirlist_sort_col >= DL_COL_EXCL)
+        dirlist_set_sort(show_shared == 2 ? (show_as ? DL_COL_ASHARED : DL_COL_SHARED) : (show_as ? DL_COL_AEXCL : DL_COL_EXCL), DL_NOCHANGE, DL_NOCHANGE);
+      break;
     case 'm':
       if (extended_info)
         show_mtime = !show_mtime;
@@ -518,6 +712,10 @@ int browse_key(int ch) {
     case 'i':
       info_show = !info_show;
       break;
+    case 'S':
+      stats_show = 1;
+      info_show = 0;
+      break;
     case '?':
       help_init();
       info_show = 0;
@@ -531,6 +729,10 @@ int browse_key(int ch) {
       }
       if(sel == NULL || sel == dirlist_parent)
         break;
+      if(dirlist_par->flags & FF_VROOT) {
+        message = "Can't delete a directory given on the command line.";
+        break;
+      }
       info_show = 0;
       if((t = dirlist_get(1)) == sel)
         if((t = dirlist_get(-1)) == sel || t == dirlist_parent)
@@ -544,6 +746,10 @@ int browse_key(int ch) {
           : "Shell feature not available for imported directories.";
         break;
       }
+      if(dirlist_par->flags & FF_VROOT) {
+        message = "No shell for the virtual directory, open one of the roots.";
+        break;
+      }
       shell_init();
       break;
     }
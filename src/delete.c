@@ -29,17 +29,23 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
 
 
 #define DS_CONFIRM  0
 #define DS_PROGRESS 1
 #define DS_FAILED   2
 
+/* Maximum number of directory descriptors to keep open while recursing,
+ * deeper directories reopen their parent by path afterwards. */
+#define DS_MAXDEPTH 128
+
 
 static struct dir *root, *nextsel, *curdir;
 static char noconfirm = 0, ignoreerr = 0, state;
 static signed char seloption;
-static int lasterrno;
+static int lasterrno, depth;
 
 
 static void delete_draw_confirm(void) {
@@ -47,7 +53,7 @@ static void delete_draw_confirm(void) {
 
   ncprint(1, 2, "Are you sure you want to delete \"%s\"%c",
     cropstr(root->name, 21), root->flags & FF_DIR ? ' ' : '?');
-  if(root->flags & FF_DIR && root->sub != NULL)
+  if(root->flags & FF_DIR && (root->sub != NULL || root->flags & FF_AGGR))
     ncprint(2, 18, "and all of its contents?");
 
   if(seloption == 0)
@@ -166,9 +172,48 @@ int delete_key(int ch) {
 }
 
 
-static int delete_dir(struct dir *dr) {
+/* Removes everything in the directory dfd. Used for directories below
+ * --max-depth, of which the contents are not in memory. */
+static int delete_contents(int dfd) {
+  DIR *dir;
+  struct dirent *ent;
+  struct stat st;
+  int fd, r = 0, err;
+
+  if((fd = dup(dfd)) < 0 || (dir = fdopendir(fd)) == NULL) {
+    if(fd >= 0)
+      close(fd);
+    return -1;
+  }
+  while(r == 0 && (ent = readdir(dir)) != NULL) {
+    if(ent->d_name[0] == '.' && (ent->d_name[1] == 0 || (ent->d_name[1] == '.' && ent->d_name[2] == 0)))
+      continue;
+    if(fstatat(dfd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+      if((fd = openat(dfd, ent->d_name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW)) < 0)
+        r = -1;
+      else {
+        r = delete_contents(fd);
+        err = errno;
+        close(fd);
+        errno = err;
+      }
+      if(r == 0)
+        r = unlinkat(dfd, ent->d_name, AT_REMOVEDIR);
+    } else
+      r = unlinkat(dfd, ent->d_name, 0);
+  }
+  err = errno;
+  closedir(dir);
+  errno = err;
+  return r;
+}
+
+
+/* Deletes dr, *fd is an open descriptor of its parent directory. *fd may be
+ * replaced with a new descriptor to the same directory, or -1 on error. */
+static int delete_dir(int *fd, struct dir *dr) {
   struct dir *nxt, *cur;
-  int r;
+  int r, dfd;
 
   /* check for input or screen resizes */
   curdir = dr;
@@ -177,22 +222,39 @@ static int delete_dir(struct dir *dr) {
 
   /* do the actual deleting */
   if(dr->flags & FF_DIR) {
-    if((r = chdir(dr->name)) < 0)
+    if((r = dfd = openat(*fd, dr->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW)) < 0)
+      goto delete_nxt;
+    if(dr->flags & FF_AGGR && delete_contents(dfd) < 0) {
+      r = errno;
+      close(dfd);
+      errno = r;
+      r = -1;
       goto delete_nxt;
+    }
     if(dr->sub != NULL) {
+      if(++depth > DS_MAXDEPTH) {
+        close(*fd);
+        *fd = -1;
+      }
       nxt = dr->sub;
       while(nxt != NULL) {
         cur = nxt;
         nxt = cur->next;
-        if(delete_dir(cur))
+        if(delete_dir(&dfd, cur)) {
+          if(dfd >= 0)
+            close(dfd);
           return 1;
+        }
       }
+      depth--;
     }
-    if((r = chdir("..")) < 0)
+    if(dfd >= 0)
+      close(dfd);
+    if(*fd < 0 && (r = *fd = path_open(getpath(dr->parent))) < 0)
       goto delete_nxt;
-    r = dr->sub == NULL ? rmdir(dr->name) : 0;
+    r = dr->sub == NULL ? unlinkat(*fd, dr->name, AT_REMOVEDIR) : 0;
   } else
-    r = unlink(dr->name);
+    r = unlinkat(*fd, dr->name, 0);
 
 delete_nxt:
   /* error occurred, ask user what to do */
@@ -213,6 +275,7 @@ delete_nxt:
 
 void delete_process() {
   struct dir *par;
+  int fd;
 
   /* confirm */
   seloption = 1;
@@ -222,8 +285,8 @@ void delete_process() {
       return;
     }
 
-  /* chdir */
-  if(path_chdir(getpath(root->parent)) < 0) {
+  /* open parent directory */
+  if((fd = path_open(getpath(root->parent))) < 0) {
     state = DS_FAILED;
     lasterrno = errno;
     while(state == DS_FAILED)
@@ -234,8 +297,11 @@ void delete_process() {
   /* delete */
   seloption = 0;
   state = DS_PROGRESS;
+  depth = 0;
   par = root->parent;
-  delete_dir(root);
+  delete_dir(&fd, root);
+  if(fd >= 0)
+    close(fd);
   if(nextsel)
     nextsel->flags |= FF_BSEL;
   browse_init(par);
@@ -98,23 +98,101 @@ struct dir_output {
  */
 void dir_mem_init(struct dir *);
 
+/* --max-depth: directories deeper than this are counted in their parent at
+ * this depth, which gets FF_AGGR. 0 for no limit. */
+extern int dir_mem_max_depth;
+
+/* Margin of error of the size of a directory with estimated items, of the
+ * disk usage or of the apparent size, at 95% confidence. 0 if exact. */
+int64_t dir_mem_margin(struct dir *, int asize);
+
+/* The tree that the initial scan is building, NULL if there is none. Items
+ * are only added to it, so it can be browsed while the scan is running. */
+struct dir *dir_mem_partial(void);
+
+/* Whether the size of a directory in the partial tree is still being
+ * counted, because items are being added below it */
+int dir_mem_counting(struct dir *);
+
+/* Forgets the estimate of a directory that is going to be freed. With top set,
+ * it is also taken out of the estimates of its parents. */
+void dir_mem_forget(struct dir *, int top);
+
+/* Takes a hard link that is going to be freed out of the table of hard links */
+void dir_mem_unlink(struct dir *);
+
 /* Initializes the SCAN state and dir_output for exporting to a file. */
 int dir_export_init(const char *fn);
 
+/* Writes the items to a file in the export format on their way to the current
+ * dir_output, flushing it once a second. Must be called after the output has
+ * been initialized. */
+int dir_checkpoint_init(const char *fn);
+/* Exits if a signal has been caught while writing a checkpoint, for when no
+ * items arrive for a while. */
+void dir_checkpoint_check(void);
+
 
 /* Function set by input code. Returns dir_output.final(). */
 extern int (*dir_process)(void);
 
 /* Scanning a live directory */
 extern int dir_scan_smfs;
+extern int dir_scan_threads;
+extern int dir_scan_uring;
+extern int dir_scan_inode_order;
+extern const char *dir_scan_incremental;
+extern const char *dir_scan_resume;
+extern int dir_scan_max_iops;
+extern int dir_scan_idle;
+extern int dir_scan_estimate;
+extern int dir_scan_breadth_first;
 void dir_scan_init(const char *path);
+/* Scans multiple directories into a single tree, under a FF_VROOT directory */
+void dir_scan_init_roots(char **paths, int n);
+int dir_scan_rate(void); /* current operations per second, with --max-iops */
+
+/* Slowest directories and directories with the most entries of the last scan,
+ * sorted in descending order once the scan has finished. */
+#define DIR_SCAN_TOP 10
+struct dir_scan_top {
+  char *path;
+  int64_t ns, read_ns; /* time spent on the directory, and on opening and reading it */
+  int items;
+};
+extern struct dir_scan_top dir_scan_slowest[DIR_SCAN_TOP], dir_scan_largest[DIR_SCAN_TOP];
+extern int dir_scan_nslowest, dir_scan_nlargest;
+
+/* Live performance figures of the current scan, updated once a second */
+struct dir_scan_perf {
+  int64_t p50, p99; /* stat() latency in ns, 0 if no calls have been made */
+  int queued;       /* number of directories waiting to be scanned */
+  int n;            /* number of workers */
+  const int *util;  /* percentage of time each worker has been scanning */
+};
+void dir_scan_perf(struct dir_scan_perf *);
+
+/* Running totals of the entries in the root directory, or of the roots when
+ * scanning several, with --breadth-first. Fills r with the n largest so far
+ * and returns how many there are. */
+struct dir_scan_rank {
+  const char *name;
+  int64_t size;
+};
+int dir_scan_ranking(struct dir_scan_rank *r, int n);
 
 /* Importing a file */
 extern int dir_import_active;
+extern uint64_t dir_import_timestamp;
+/* With dir_import_partial set, a file that has been cut off is read up to the
+ * last complete item, after which the directories that were still open are
+ * closed. dir_import_truncated is set while they are being closed. */
+extern int dir_import_partial;
+extern int dir_import_truncated;
 int dir_import_init(const char *fn);
 
-#if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
-extern int exclude_kernfs;
+#if HAVE_STATX && HAVE_SYS_SYSMACROS_H
+extern int fast_stat;
 #endif
 
 
@@ -135,6 +213,8 @@ extern char *dir_fatalerr;
 void dir_seterr(const char *, ...);
 
 extern int dir_ui;
+/* Whether the partial tree is being browsed instead of showing the progress */
+extern int dir_browse;
 int dir_key(int);
 void dir_draw(void);
 
@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
 
 
 int (*dir_process)(void);
@@ -36,11 +37,14 @@ char *dir_curpath;   /* Full path of the last seen item. */
 struct dir_output dir_output;
 char *dir_fatalerr; /* Error message on a fatal error. (NULL if there was no fatal error) */
 int dir_ui;         /* User interface to use */
+int dir_browse;     /* Browsing the partial tree during the scan */
 static int confirm_quit_while_scanning_stage_1_passed; /* Additional check before quitting */
 static char *lasterr; /* Path where the last error occurred. */
 static int curpathl; /* Allocated length of dir_curpath */
 static int lasterrl; /* ^ of lasterr */
 
+#define PROGRESS_RANK 10 /* maximum number of entries in the --breadth-first ranking */
+
 
 static void curpath_resize(int s) {
   if(curpathl < s) {
@@ -107,6 +111,50 @@ void dir_seterr(const char *fmt, ...) {
 }
 
 
+/* Number of items and bytes per second, averaged over at least a second. The
+ * bytes are 0 if the output doesn't keep track of the size. */
+static void progress_rate(int *items, int64_t *bytes) {
+  static struct timespec last;
+  static int lastitems, irate;
+  static int64_t lastsize, brate;
+  struct timespec now;
+  double dt;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  /* A new scan has started */
+  if(dir_output.items < lastitems) {
+    last.tv_sec = 0;
+    irate = brate = 0;
+  }
+  dt = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1e9;
+  if(dt >= 1.0) {
+    if(last.tv_sec) {
+      irate = (int)((dir_output.items - lastitems) / dt);
+      brate = (int64_t)((dir_output.size - lastsize) / dt);
+    }
+    last = now;
+    lastitems = dir_output.items;
+    lastsize = dir_output.size;
+  }
+  *items = irate;
+  *bytes = brate < 0 ? 0 : brate;
+}
+
+
+static char *fmtns(int64_t ns) {
+  static char buf[16];
+  if(ns < 1000)
+    sprintf(buf, "%d ns", (int)ns);
+  else if(ns < 1000000)
+    sprintf(buf, "%.1f us", ns / 1e3);
+  else if(ns < 1000000000)
+    sprintf(buf, "%.1f ms", ns / 1e6);
+  else
+    sprintf(buf, "%.1f s", ns / 1e9);
+  return buf;
+}
+
+
 static void draw_progress(void) {
   static const char scantext[] = "Scanning...";
   static const char loadtext[] = "Loading...";
@@ -114,9 +162,19 @@ static void draw_progress(void) {
   const char *antext = dir_import_active ? loadtext : scantext;
   char ani[16] = {0};
   size_t i;
-  int width = wincols-5;
-
-  nccreate(10, width, antext);
+  int width = wincols-5, irate, x, nrank = 0, foot = 11;
+  int64_t brate;
+  struct dir_scan_perf perf;
+  struct dir_scan_rank rank[PROGRESS_RANK];
+
+  /* With --breadth-first, the largest top-level entries so far go below the
+   * warning */
+  x = winrows-16 < PROGRESS_RANK ? winrows-16 : PROGRESS_RANK;
+  if(!dir_import_active && dir_scan_breadth_first && x > 0)
+    nrank = dir_scan_ranking(rank, x);
+  if(nrank)
+    foot += nrank+1;
+  nccreate(foot+2, width, antext);
 
   ncaddstr(2, 2, "Total items: ");
   uic_set(UIC_NUM);
@@ -129,12 +187,54 @@ static void draw_progress(void) {
 
   uic_set(UIC_DEFAULT);
   ncprint(3, 2, "Current item: %s", cropstr(dir_curpath, width-18));
+
+  progress_rate(&irate, &brate);
+  ncprint(4, 2, "Speed: %d items/s", irate);
+  if(brate) {
+    addstr(", ");
+    printsize(UIC_DEFAULT, brate);
+    addstr("/s");
+  }
+
+  if(!dir_import_active) {
+    dir_scan_perf(&perf);
+    ncprint(5, 2, "Queued directories: %d", perf.queued);
+    if(perf.p50) {
+      ncprint(5, 34, "stat() p50: %s", fmtns(perf.p50));
+      printw(", p99: %s", fmtns(perf.p99));
+    }
+    if(perf.n > 1) {
+      ncaddstr(6, 2, "Workers busy:");
+      for(i=0, x=16; i<(size_t)perf.n && x+5 < width-1; i++, x+=5)
+        ncprint(6, x, "%3d%%", perf.util[i]);
+    }
+    if(dir_scan_max_iops)
+      ncprint(7, 2, "Rate: %d/%d operations per second", dir_scan_rate(), dir_scan_max_iops);
+  }
+
+  if(nrank) {
+    attron(A_BOLD);
+    ncaddstr(10, 2, "Largest so far:");
+    attroff(A_BOLD);
+    for(i=0; i<(size_t)nrank; i++) {
+      ncmove(11+i, 4);
+      printsize(UIC_DEFAULT, rank[i].size);
+      ncaddstr(11+i, 15, cropstr(rank[i].name, width-18));
+    }
+  }
+
   if(confirm_quit_while_scanning_stage_1_passed) {
-    ncaddstr(8, width-26, "Press ");
+    ncaddstr(foot, width-26, "Press ");
     addchc(UIC_KEY, 'y');
     addstrc(UIC_DEFAULT, " to confirm abort");
+  } else if(dir_mem_partial()) {
+    ncaddstr(foot, width-31, "Press ");
+    addchc(UIC_KEY, 'b');
+    addstrc(UIC_DEFAULT, " to browse, ");
+    addchc(UIC_KEY, 'q');
+    addstrc(UIC_DEFAULT, " to abort");
   } else {
-    ncaddstr(8, width-18, "Press ");
+    ncaddstr(foot, width-18, "Press ");
     addchc(UIC_KEY, 'q');
     addstrc(UIC_DEFAULT, " to abort");
   }
@@ -142,10 +242,10 @@ static void draw_progress(void) {
   /* show warning if we couldn't open a dir */
   if(lasterr) {
      attron(A_BOLD);
-     ncaddstr(5, 2, "Warning:");
+     ncaddstr(8, 2, "Warning:");
      attroff(A_BOLD);
-     ncprint(5, 11, "error scanning %-32s", cropstr(lasterr, width-28));
-     ncaddstr(6, 3, "some directory sizes may not be correct");
+     ncprint(8, 11, "error scanning %-32s", cropstr(lasterr, width-28));
+     ncaddstr(9, 3, "some directory sizes may not be correct");
   }
 
   /* animation - but only if the screen refreshes more than or once every second */
@@ -161,7 +261,7 @@ static void draw_progress(void) {
         ani[i] = antext[i];
   } else
     strcpy(ani, antext);
-  ncaddstr(8, 3, ani);
+  ncaddstr(foot, 3, ani);
 }
 
 
@@ -182,6 +282,8 @@ static void draw_error(char *cur, char *msg) {
 void dir_draw() {
   float f;
   const char *unit;
+  int irate;
+  int64_t brate;
 
   switch(dir_ui) {
   case 0:
@@ -191,18 +293,26 @@ void dir_draw() {
   case 1:
     if(dir_fatalerr)
       fprintf(stderr, "\r%s.\n", dir_fatalerr);
-    else if(dir_output.size) {
-      f = formatsize(dir_output.size, &unit);
-      fprintf(stderr, "\r%-55s %8d files /%5.1f %s",
-        cropstr(dir_curpath, 55), dir_output.items, f, unit);
-    } else
-      fprintf(stderr, "\r%-65s %8d files", cropstr(dir_curpath, 65), dir_output.items);
+    else {
+      progress_rate(&irate, &brate);
+      if(dir_output.size) {
+        f = formatsize(dir_output.size, &unit);
+        fprintf(stderr, "\r%-40s %8d files /%5.1f %s %7d/s",
+          cropstr(dir_curpath, 40), dir_output.items, f, unit, irate);
+      } else
+        fprintf(stderr, "\r%-50s %8d files %7d/s", cropstr(dir_curpath, 50), dir_output.items, irate);
+    }
     break;
   case 2:
+    /* Pick up the items and sizes that have been added since the last time */
+    if(dir_browse && !dir_fatalerr) {
+      dirlist_open(dirlist_par);
+      dirlist_top(0);
+    }
     browse_draw();
     if(dir_fatalerr)
       draw_error(dir_curpath, dir_fatalerr);
-    else
+    else if(!dir_browse)
       draw_progress();
     break;
   }
@@ -212,8 +322,28 @@ void dir_draw() {
 /* This function can't be called unless dir_ui == 2
  * (Doesn't really matter either way). */
 int dir_key(int ch) {
+  struct dir *t;
+
   if(dir_fatalerr)
     return 1;
+
+  /* Browsing the partial tree, q goes back to the progress window */
+  if(dir_browse) {
+    if(ch == 'q' || ch == 'b')
+      dir_browse = 0;
+    else
+      browse_key(ch);
+    return 0;
+  }
+  if(ch == 'b' && (t = dir_mem_partial()) != NULL) {
+    dir_browse = 1;
+    if(!dirlist_par) {
+      dirlist_open(t);
+      dirlist_top(-3);
+    }
+    return 0;
+  }
+
   if(confirm_quit && confirm_quit_while_scanning_stage_1_passed) {
     if (ch == 'y'|| ch == 'Y') {
       return 1;
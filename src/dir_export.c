@@ -29,10 +29,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
 
 
 static FILE *stream;
 
+/* Output is collected here and handed to stream in large writes, which is a
+ * lot cheaper than the dozen stdio calls each item would take otherwise */
+#define BUF_SIZE (64*1024)
+static char buf[BUF_SIZE];
+static size_t buflen;
+
+/* Offset of the space reserved for the scan statistics in the metadata, or -1.
+ * These are only known at the end of the scan, so they are written over the
+ * padding afterwards. Not possible when the output isn't seekable. */
+#define STATS_SPACE 8192
+static long statspos;
+
 /* Stack of device IDs, also used to keep track of the level of nesting */
 static struct stack {
   uint64_t *list;
@@ -40,21 +53,68 @@ static struct stack {
 } stack;
 
 
+static void output_flush(void) {
+  if(buflen)
+    fwrite(buf, 1, buflen, stream);
+  buflen = 0;
+}
+
+
+static void output_mem(const char *s, size_t n) {
+  if(buflen + n > BUF_SIZE) {
+    output_flush();
+    if(n > BUF_SIZE) {
+      fwrite(s, 1, n, stream);
+      return;
+    }
+  }
+  memcpy(buf+buflen, s, n);
+  buflen += n;
+}
+
+#define output_lit(s) output_mem(s, sizeof(s)-1)
+
+
+static void output_char(char c) {
+  if(buflen == BUF_SIZE)
+    output_flush();
+  buf[buflen++] = c;
+}
+
+
+/* Whether a character has to be escaped in a JSON string */
+static int escape(unsigned char c) {
+  return c <= 31 || c == 127 || c == '\\' || c == '"';
+}
+
+
 static void output_string(const char *str) {
+  const char *s;
+  char tmp[8];
+
   for(; *str; str++) {
+    /* Write runs of plain characters at once */
+    for(s=str; *s && !escape(*s); s++)
+      ;
+    if(s > str) {
+      output_mem(str, s-str);
+      if(!*s)
+        break;
+      str = s;
+    }
     switch(*str) {
-    case '\n': fputs("\\n", stream); break;
-    case '\r': fputs("\\r", stream); break;
-    case '\b': fputs("\\b", stream); break;
-    case '\t': fputs("\\t", stream); break;
-    case '\f': fputs("\\f", stream); break;
-    case '\\': fputs("\\\\", stream); break;
-    case '"':  fputs("\\\"", stream); break;
+    case '\n': output_lit("\\n"); break;
+    case '\r': output_lit("\\r"); break;
+    case '\b': output_lit("\\b"); break;
+    case '\t': output_lit("\\t"); break;
+    case '\f': output_lit("\\f"); break;
+    case '\\': output_lit("\\\\"); break;
+    case '"':  output_lit("\\\""); break;
     default:
       if((unsigned char)*str <= 31 || (unsigned char)*str == 127)
-        fprintf(stream, "\\u00%02x", *str);
+        output_mem(tmp, snprintf(tmp, sizeof(tmp), "\\u00%02x", *str));
       else
-        fputc(*str, stream);
+        output_char(*str);
       break;
     }
   }
@@ -63,14 +123,68 @@ static void output_string(const char *str) {
 
 static void output_int(uint64_t n) {
   char tmp[20];
-  int i = 0;
+  int i = sizeof(tmp);
 
   do
-    tmp[i++] = n % 10;
+    tmp[--i] = '0' + n % 10;
   while((n /= 10) > 0);
 
-  while(i--)
-    fputc(tmp[i]+'0', stream);
+  output_mem(tmp+i, sizeof(tmp)-i);
+}
+
+
+/* Number of bytes output_string() writes for str */
+static size_t string_len(const char *str) {
+  size_t n = 0;
+  for(; *str; str++)
+    n += strchr("\n\r\b\t\f\\\"", *str) ? 2 : (unsigned char)*str <= 31 || (unsigned char)*str == 127 ? 6 : 1;
+  return n;
+}
+
+
+static void output_top(const char *key, struct dir_scan_top *top, int n, size_t *space) {
+  int i;
+
+  output_char('"');
+  output_mem(key, strlen(key));
+  output_lit("\":[");
+  for(i=0; i<n; i++) {
+    /* Leave room for the closing brackets, stop when we run out of space */
+    if(string_len(top[i].path) + 96 > *space)
+      break;
+    *space -= string_len(top[i].path) + 96;
+    if(i)
+      output_char(',');
+    output_lit("{\"path\":\"");
+    output_string(top[i].path);
+    output_lit("\",\"items\":");
+    output_int((uint64_t)top[i].items);
+    output_lit(",\"usec\":");
+    output_int((uint64_t)top[i].ns / 1000);
+    output_lit(",\"read_usec\":");
+    output_int((uint64_t)top[i].read_ns / 1000);
+    output_char('}');
+  }
+  output_char(']');
+}
+
+
+/* Writes the scan statistics over the space reserved in the metadata */
+static void output_stats(void) {
+  size_t space = STATS_SPACE - 64;
+  long end;
+
+  output_flush();
+  end = ftell(stream);
+  if(statspos < 0 || end < 0 || fseek(stream, statspos, SEEK_SET))
+    return;
+  output_char('{');
+  output_top("slowest", dir_scan_slowest, dir_scan_nslowest, &space);
+  output_char(',');
+  output_top("largest", dir_scan_largest, dir_scan_nlargest, &space);
+  output_char('}');
+  output_flush();
+  fseek(stream, end, SEEK_SET);
 }
 
 
@@ -78,56 +192,62 @@ static void output_info(struct dir *d, const char *name, struct dir_ext *e) {
   if(!extended_info || !(d->flags & FF_EXT))
     e = NULL;
 
-  fputs("{\"name\":\"", stream);
+  output_lit("{\"name\":\"");
   output_string(name);
-  fputc('"', stream);
+  output_char('"');
 
   /* No need for asize/dsize if they're 0 (which happens with excluded or failed-to-stat files) */
   if(d->asize) {
-    fputs(",\"asize\":", stream);
+    output_lit(",\"asize\":");
     output_int((uint64_t)d->asize);
   }
   if(d->size) {
-    fputs(",\"dsize\":", stream);
+    output_lit(",\"dsize\":");
     output_int((uint64_t)d->size);
   }
 
   if(d->dev != nstack_top(&stack, 0)) {
-    fputs(",\"dev\":", stream);
+    output_lit(",\"dev\":");
     output_int(d->dev);
   }
-  fputs(",\"ino\":", stream);
+  output_lit(",\"ino\":");
   output_int(d->ino);
 
   if(e) {
-    fputs(",\"uid\":", stream);
+    output_lit(",\"uid\":");
     output_int(e->uid);
-    fputs(",\"gid\":", stream);
+    output_lit(",\"gid\":");
     output_int(e->gid);
-    fputs(",\"mode\":", stream);
+    output_lit(",\"mode\":");
     output_int(e->mode);
-    fputs(",\"mtime\":", stream);
+    output_lit(",\"mtime\":");
     output_int(e->mtime);
   }
 
   /* TODO: Including the actual number of links would be nicer. */
   if(d->flags & FF_HLNKC)
-    fputs(",\"hlnkc\":true", stream);
+    output_lit(",\"hlnkc\":true");
   if(d->flags & FF_ERR)
-    fputs(",\"read_error\":true", stream);
+    output_lit(",\"read_error\":true");
   /* excluded/error'd files are "unknown" with respect to the "notreg" field. */
-  if(!(d->flags & (FF_DIR|FF_FILE|FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)))
-    fputs(",\"notreg\":true", stream);
+  if(!(d->flags & (FF_DIR|FF_FILE|FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK|FF_BNDMNT)))
+    output_lit(",\"notreg\":true");
   if(d->flags & FF_EXL)
-    fputs(",\"excluded\":\"pattern\"", stream);
+    output_lit(",\"excluded\":\"pattern\"");
   else if(d->flags & FF_OTHFS)
-    fputs(",\"excluded\":\"othfs\"", stream);
+    output_lit(",\"excluded\":\"othfs\"");
   else if(d->flags & FF_KERNFS)
-    fputs(",\"excluded\":\"kernfs\"", stream);
+    output_lit(",\"excluded\":\"kernfs\"");
   else if(d->flags & FF_FRMLNK)
-    fputs(",\"excluded\":\"frmlnk\"", stream);
-
-  fputc('}', stream);
+    output_lit(",\"excluded\":\"frmlnk\"");
+  else if(d->flags & FF_BNDMNT)
+    output_lit(",\"excluded\":\"bindmnt\"");
+  if(d->flags & FF_VROOT)
+    output_lit(",\"virtual\":true");
+  if(d->flags & FF_EST)
+    output_lit(",\"estimated\":true");
+
+  output_char('}');
 }
 
 
@@ -135,15 +255,22 @@ static void output_info(struct dir *d, const char *name, struct dir_ext *e) {
  * without checking the return values of the functions. Only at the and of each
  * item() call do we check for ferror(). This greatly simplifies the code, but
  * assumes that calls to fwrite()/fput./etc don't do any weird stuff when
- * called with a stream that's in an error state. */
+ * called with a stream that's in an error state. Since the output is buffered,
+ * an error shows up only at the item that fills the buffer. */
 static int item(struct dir *item, const char *name, struct dir_ext *ext) {
+  int r;
+
   if(!item) {
     nstack_pop(&stack);
     if(!stack.top) { /* closing of the root item */
-      fputs("]]", stream);
-      return fclose(stream);
+      output_lit("]]");
+      output_flush();
+      output_stats();
+      r = fclose(stream);
+      stream = NULL;
+      return r;
     } else /* closing of a regular directory item */
-      fputs("]", stream);
+      output_lit("]");
     return ferror(stream);
   }
 
@@ -152,14 +279,22 @@ static int item(struct dir *item, const char *name, struct dir_ext *ext) {
   /* File header.
    * TODO: Add scan options? */
   if(!stack.top) {
-    fputs("[1,1,{\"progname\":\""PACKAGE"\",\"progver\":\""PACKAGE_VERSION"\",\"timestamp\":", stream);
+    output_lit("[1,1,{\"progname\":\""PACKAGE"\",\"progver\":\""PACKAGE_VERSION"\",\"timestamp\":");
     output_int((uint64_t)time(NULL));
-    fputc('}', stream);
+    statspos = -1;
+    output_flush();
+    if(!dir_import_active && ftell(stream) >= 0) {
+      output_lit(",\"scanstats\":");
+      output_flush();
+      statspos = ftell(stream);
+      fprintf(stream, "{}%*s", STATS_SPACE-2, "");
+    }
+    output_char('}');
   }
 
-  fputs(",\n", stream);
+  output_lit(",\n");
   if(item->flags & FF_DIR)
-    fputc('[', stream);
+    output_char('[');
 
   output_info(item, name, ext);
 
@@ -192,3 +327,113 @@ int dir_export_init(const char *fn) {
   return 0;
 }
 
+
+/* A checkpoint is an export that is written alongside the actual output. The
+ * buffered data is flushed once a second, so that the file is at most a second
+ * behind when ncdu is killed, and on SIGINT, SIGTERM and SIGHUP, after which
+ * ncdu exits. The signal is acted upon at the next item or while waiting for
+ * the scan threads, a second one terminates ncdu right away in case the scan
+ * is stuck. Whatever has been written can be given to --resume. */
+static struct dir_output next;
+static time_t flushed;
+static volatile sig_atomic_t caught;
+static int handlers;
+static struct sigaction oldact[3];
+static const int signals[3] = { SIGINT, SIGTERM, SIGHUP };
+
+
+static void checkpoint_signal(int sig) {
+  if(caught) {
+    signal(sig, SIG_DFL);
+    raise(sig);
+  }
+  caught = sig;
+}
+
+
+/* The handlers are installed once the first item arrives, after ncurses has
+ * installed its own, which are restored afterwards */
+static void checkpoint_handlers(int set) {
+  struct sigaction act;
+  int i;
+
+  memset(&act, 0, sizeof(act));
+  act.sa_handler = checkpoint_signal;
+  act.sa_flags = SA_RESTART;
+  sigemptyset(&act.sa_mask);
+  for(i=0; i<3; i++)
+    sigaction(signals[i], set ? &act : oldact+i, set ? oldact+i : NULL);
+}
+
+
+static void checkpoint_exit(void) {
+  if(stream) {
+    output_flush();
+    fflush(stream);
+  }
+  close_nc();
+  signal(caught, SIG_DFL);
+  raise(caught);
+  exit(1);
+}
+
+
+static int checkpoint_item(struct dir *d, const char *name, struct dir_ext *e) {
+  time_t now;
+
+  if(!handlers) {
+    checkpoint_handlers(1);
+    handlers = 1;
+  }
+  if(stream) {
+    if(item(d, name, e))
+      return 1;
+    if(stream && (now = time(NULL)) != flushed) {
+      flushed = now;
+      output_flush();
+      fflush(stream);
+    }
+  }
+  if(caught)
+    checkpoint_exit();
+  return next.item(d, name, e);
+}
+
+
+void dir_checkpoint_check(void) {
+  if(caught)
+    checkpoint_exit();
+}
+
+
+static int checkpoint_final(int fail) {
+  if(caught)
+    checkpoint_exit();
+  if(handlers) {
+    checkpoint_handlers(0);
+    handlers = 0;
+  }
+  if(stream) {
+    output_flush();
+    fclose(stream);
+    stream = NULL;
+  }
+  nstack_free(&stack);
+  dir_output.item = next.item;
+  dir_output.final = next.final;
+  return next.final(fail);
+}
+
+
+int dir_checkpoint_init(const char *fn) {
+  if((stream = fopen(fn, "w")) == NULL)
+    return 1;
+
+  nstack_init(&stack);
+  flushed = time(NULL);
+  next = dir_output;
+  dir_output.item = checkpoint_item;
+  dir_output.final = checkpoint_final;
+  return 0;
+}
+
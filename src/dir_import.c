@@ -56,6 +56,9 @@
 
 
 int dir_import_active = 0;
+uint64_t dir_import_timestamp;
+int dir_import_partial;
+int dir_import_truncated;
 
 
 /* Use a struct for easy batch-allocation and deallocation of state data. */
@@ -66,6 +69,7 @@ static struct ctx {
   int byte;
   int eof;
   int items;
+  int depth; /* number of directories passed to dir_output that are still open */
   char *buf; /* points into readbuf, always zero-terminated. */
   char *lastfill; /* points into readbuf, location of the zero terminator. */
 
@@ -124,10 +128,15 @@ static int fill(int n) {
 }
 
 
+/* Input that ends within the last few bytes of the buffer has been cut off in
+ * the middle of an item, rather than being invalid. The longest token that can
+ * be cut off before the end of the buffer is a \u escape. */
+#define truncated() (dir_import_partial && ctx->eof && ctx->lastfill - ctx->buf < 6)
+
 /* Two macros that break function calling behaviour, but are damn convenient */
 #define E(_x, _m) do {\
     if(_x) {\
-      if(!dir_fatalerr)\
+      if(!dir_fatalerr && !(dir_import_truncated = truncated()))\
         dir_seterr("Line %d byte %d: %s", ctx->line, ctx->byte, _m);\
       return 1;\
     }\
@@ -376,6 +385,34 @@ static int rval(void) {
 }
 
 
+/* Reads the metadata object, only the timestamp is used */
+static int metadata(void) {
+  uint64_t v;
+
+  C(rfill1);
+  E(*ctx->buf != '{', "Expected JSON object");
+  con(1);
+  while(1) {
+    C(cons());
+    if(*ctx->buf == '}')
+      break;
+    C(rkey(ctx->val, MAX_VAL));
+    if(strcmp(ctx->val, "timestamp") == 0) {
+      C(rint64(&v, UINT64_MAX));
+      dir_import_timestamp = v;
+    } else
+      C(rval());
+    C(cons());
+    if(*ctx->buf == '}')
+      break;
+    E(*ctx->buf != ',', "Expected ',' or '}'");
+    con(1);
+  }
+  con(1);
+  return 0;
+}
+
+
 /* Consumes everything up to the root item, and checks that this item is a dir. */
 static int header(void) {
   uint64_t v;
@@ -390,8 +427,8 @@ static int header(void) {
   C(cons() || rint64(&v, 10000) || cons()); /* Ignore the minor version for now */
   E(*ctx->buf != ',', "Expected ','");
   con(1);
-  /* Metadata block is currently ignored */
-  C(cons() || rval() || cons());
+  dir_import_timestamp = 0;
+  C(cons() || metadata() || cons());
   E(*ctx->buf != ',', "Expected ','");
   con(1);
 
@@ -484,8 +521,22 @@ static int iteminfo(void) {
         ctx->buf_dir->flags |= FF_KERNFS;
       else if(strcmp(ctx->val, "frmlnk") == 0)
         ctx->buf_dir->flags |= FF_FRMLNK;
+      else if(strcmp(ctx->val, "bindmnt") == 0)
+        ctx->buf_dir->flags |= FF_BNDMNT;
       else
         ctx->buf_dir->flags |= FF_EXL;
+    } else if(strcmp(ctx->val, "virtual") == 0) {    /* virtual */
+      if(*ctx->buf == 't') {
+        C(rlit("true", 4));
+        ctx->buf_dir->flags |= FF_VROOT;
+      } else
+        C(rlit("false", 5));
+    } else if(strcmp(ctx->val, "estimated") == 0) {  /* estimated */
+      if(*ctx->buf == 't') {
+        C(rlit("true", 4));
+        ctx->buf_dir->flags |= FF_EST;
+      } else
+        C(rlit("false", 5));
     } else if(strcmp(ctx->val, "notreg") == 0) {     /* notreg */
       if(*ctx->buf == 't') {
         C(rlit("true", 4));
@@ -543,7 +594,9 @@ static int item(uint64_t dev) {
       dir_seterr("Output error: %s", strerror(errno));
       return 1;
     }
+    ctx->depth++;
     C(itemdir(dev));
+    ctx->depth--;
     if(dir_output.item(NULL, 0, NULL)) {
       dir_seterr("Output error: %s", strerror(errno));
       return 1;
@@ -575,10 +628,15 @@ static int process(void) {
 
   header();
 
-  if(!dir_fatalerr)
+  if(!dir_fatalerr && !dir_import_truncated)
     fail = item(0);
 
-  if(!dir_fatalerr && !fail)
+  /* Close the directories that were open where the input was cut off */
+  if(dir_import_truncated) {
+    for(fail=0; ctx->depth > 0 && !fail; ctx->depth--)
+      if((fail = dir_output.item(NULL, 0, NULL)) != 0)
+        dir_seterr("Output error: %s", strerror(errno));
+  } else if(!dir_fatalerr && !fail)
     footer();
 
   if(fclose(ctx->stream) && !dir_fatalerr && !fail)
@@ -602,7 +660,7 @@ int dir_import_init(const char *fn) {
   ctx = xmalloc(sizeof(struct ctx));
   ctx->stream = stream;
   ctx->line = 1;
-  ctx->byte = ctx->eof = ctx->items = 0;
+  ctx->byte = ctx->eof = ctx->items = ctx->depth = 0;
   ctx->buf = ctx->lastfill = ctx->readbuf;
   ctx->buf_dir = xmalloc(dir_memsize(""));
   ctx->readbuf[0] = 0;
@@ -610,6 +668,7 @@ int dir_import_init(const char *fn) {
   dir_curpath_set(fn);
   dir_process = process;
   dir_import_active = 1;
+  dir_import_truncated = 0;
   return 0;
 }
 
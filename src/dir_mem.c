@@ -27,6 +27,7 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 
 #include <khashl.h>
 
@@ -34,59 +35,232 @@
 static struct dir *root;   /* root directory struct we're scanning */
 static struct dir *curdir; /* directory item that we're currently adding items to */
 static struct dir *orig;   /* original directory, when refreshing an already scanned dir */
+static int depth;          /* depth of curdir, the root is at 0 */
+static int skip;           /* number of directories below --max-depth that we're in */
+static int building;       /* whether an initial scan is adding items to root */
 
-/* Table of struct dir items with more than one link (in order to detect hard links) */
+int dir_mem_max_depth;
+
+/* Table of struct dir items with more than one link (in order to detect hard
+ * links), holding one link of each circular hlnk list. It is kept along with
+ * the tree and updated by freedir(), so that a refresh doesn't have to fill it
+ * again from the whole tree. */
 #define hlink_hash(d)     (kh_hash_uint64((khint64_t)d->dev) ^ kh_hash_uint64((khint64_t)d->ino))
 #define hlink_equal(a, b) ((a)->dev == (b)->dev && (a)->ino == (b)->ino)
 KHASHL_SET_INIT(KH_LOCAL, hl_t, hl, struct dir *, hlink_hash, hlink_equal)
 static hl_t *links = NULL;
 
+/* Hard links below --max-depth, which don't have a struct dir, and the
+ * directory that the last of them has been counted in */
+struct agl {
+  uint64_t dev, ino;
+};
+#define agl_hash(k)     (kh_hash_uint64((khint64_t)(k).dev) ^ kh_hash_uint64((khint64_t)(k).ino))
+#define agl_equal(a, b) ((a).dev == (b).dev && (a).ino == (b).ino)
+KHASHL_MAP_INIT(KH_LOCAL, ag_t, ag, struct agl, struct dir *, agl_hash, agl_equal)
+static ag_t *agl = NULL;
+
+/* Variance of the sizes of directories with estimated items (--estimate).
+ * Kept while browsing, freedir() removes the directories it frees. */
+struct est {
+  double size, asize;
+};
+#define est_hash(d) kh_hash_uint64((khint64_t)(uintptr_t)(d))
+KHASHL_MAP_INIT(KH_LOCAL, es_t, es, struct dir *, struct est, est_hash, kh_eq_generic)
+static es_t *ests = NULL;
+
+
+/* Number of parents of d, -1 for NULL */
+static int hlink_depth(struct dir *d) {
+  int n = -1;
+  for(; d; d=d->parent)
+    n++;
+  return n;
+}
 
-/* recursively checks a dir structure for hard links and fills the lookup array */
-static void hlink_init(struct dir *d) {
-  struct dir *t;
 
-  for(t=d->sub; t!=NULL; t=t->next)
-    hlink_init(t);
+/* Whether d is in the tree that is being built */
+static int hlink_new(struct dir *d) {
+  for(; d; d=d->parent)
+    if(d == root)
+      return 1;
+  return 0;
+}
 
-  if(!(d->flags & FF_HLNKC))
-    return;
-  int r;
-  hl_put(links, d, &r);
+
+/* The circular hlnk lists are kept in a depth-first order, in which the links
+ * below any directory are next to each other. The directories that contain
+ * both a link and any other link are then those that contain the link and one
+ * of its neighbours.
+ *
+ * Finds the link after which the first link to the same file in the tree that
+ * is being built goes in the list of t: at the end of the links that have the
+ * deepest common parent with d, or if those are all links, between two that
+ * have the shallowest common parent. */
+static struct dir *hlink_place(struct dir *d, struct dir *t) {
+  struct dir *u = t, *best = t;
+  int a, b, besta = -2, bestb = 0;
+
+  if(!t->hlnk)
+    return t;
+  do {
+    a = hlink_depth(getlca(d, u));
+    b = hlink_depth(getlca(u, u->hlnk));
+    if(a > besta || (a == besta && b < bestb)) {
+      best = u;
+      besta = a;
+      bestb = b;
+    }
+    u = u->hlnk;
+  } while(u != t);
+  return best;
 }
 
 
-/* checks an individual file for hard links and updates its cicrular linked
- * list, also updates the sizes of the parent dirs */
+/* checks an individual file for hard links and updates its circular linked
+ * list, also updates the sizes of the parent dirs. The file is counted in the
+ * parents that don't contain another link to it yet. The table holds the last
+ * link that has been added, further links from the tree that is being built go
+ * right after it.
+ *
+ * A directory that contains some but not all links to a file has exactly one
+ * link in it that is followed by a link outside of it, so the shared sizes
+ * are kept by adding each link to the directories that contain it but not the
+ * next link. Inserting d between t and n = t->hlnk adds d to the directories
+ * below b = lca(d, n), and for t replaces c = lca(t, n) with a = lca(t, d).
+ * Two of a, b and c are the same directory and the third is at or below it,
+ * so c only has to be looked up when a == b.
+ *
+ * Links below --max-depth have been counted in the directories they were
+ * aggregated into and their parents. Since items arrive in depth-first order,
+ * the last of those directories has the deepest common parent with d, and d
+ * isn't added to that one or above. */
 static void hlink_check(struct dir *d) {
-  struct dir *t, *pt, *par;
-  int i;
-
-  /* add to links table */
-  khint_t k = hl_put(links, d, &i);
+  struct dir *t = NULL, *n = NULL, *par, *a = NULL, *b = NULL, *g = NULL;
+  struct agl key;
+  int absent, counted = 0;
+  khint_t k2, k = hl_put(links, d, &absent);
+
+  if(agl) {
+    key.dev = d->dev;
+    key.ino = d->ino;
+    if((k2 = ag_get(agl, key)) != kh_end(agl))
+      g = getlca(d, kh_val(agl, k2));
+  }
 
-  /* found in the table? update hlnk */
-  if(!i) {
+  if(absent)
+    d->hlnk = NULL;
+  else {
     t = kh_key(links, k);
-    d->hlnk = t->hlnk == NULL ? t : t->hlnk;
+    if(!hlink_new(t))
+      t = hlink_place(d, t);
+    n = t->hlnk;
+    d->hlnk = n == NULL ? t : n;
     t->hlnk = d;
+    kh_key(links, k) = d;
+    a = getlca(d, t);
+    b = getlca(d, d->hlnk);
+  }
+
+  for(par=d->parent; par && par!=a && par!=b; par=par->parent) {
+    if(par == g)
+      counted = 1;
+    if(counted)
+      continue;
+    par->size = adds64(par->size, d->size);
+    par->asize = adds64(par->asize, d->asize);
   }
 
-  /* now update the sizes of the parent directories,
-   * This works by only counting this file in the parent directories where this
-   * file hasn't been counted yet, which can be determined from the hlnk list.
-   * XXX: This may not be the most efficient algorithm to do this */
-  for(i=1,par=d->parent; i&&par; par=par->parent) {
-    if(d->hlnk)
-      for(t=d->hlnk; i&&t!=d; t=t->hlnk)
-        for(pt=t->parent; i&&pt; pt=pt->parent)
-          if(pt==par)
-            i=0;
-    if(i) {
-      par->size = adds64(par->size, d->size);
-      par->asize = adds64(par->asize, d->asize);
+  /* par is now the deeper one of a and b */
+  if(absent)
+    return;
+  addsharedstats(d->parent, b, d->size, d->asize);
+  if(!n)
+    addsharedstats(t->parent, a, t->size, t->asize);
+  else if(a == b)
+    addsharedstats(getlca(t, n), a, t->size, t->asize);
+  else if(par == a)
+    addsharedstats(a, b, -t->size, -t->asize);
+}
+
+
+void dir_mem_unlink(struct dir *d) {
+  khint_t k;
+
+  if(!links || (k = hl_get(links, d)) == kh_end(links) || kh_key(links, k) != d)
+    return;
+  if(d->hlnk)
+    kh_key(links, k) = d->hlnk;
+  else
+    hl_del(links, k);
+}
+
+
+/* Called when all items of a directory with estimates have been added. The
+ * estimated items are a simple random sample of the non-directories, the
+ * variance of their total follows from the sizes of the other files. That of
+ * the subdirectories is added to it. */
+static void est_close(struct dir *d) {
+  struct dir *t;
+  struct est e = {0, 0};
+  double n = 0, m = 0, s = 0, ss = 0, a = 0, aa = 0, f;
+  khint_t k;
+  int absent;
+
+  for(t=d->sub; t; t=t->next) {
+    if(t->flags & FF_DIR) {
+      if(t->flags & FF_EST && ests && (k = es_get(ests, t)) != kh_end(ests)) {
+        e.size += kh_val(ests, k).size;
+        e.asize += kh_val(ests, k).asize;
+      }
+    } else if(t->flags & FF_EST)
+      m++;
+    else if(!(t->flags & (FF_ERR|FF_EXL))) {
+      n++;
+      s += t->size;
+      ss += (double)t->size * t->size;
+      a += t->asize;
+      aa += (double)t->asize * t->asize;
     }
   }
+
+  /* N^2 (1-n/N) var/n, with N=n+m and var the sample variance */
+  if(m && n > 1) {
+    f = (n+m) * m / n / (n-1);
+    e.size += f * (ss - s*s/n > 0 ? ss - s*s/n : 0);
+    e.asize += f * (aa - a*a/n > 0 ? aa - a*a/n : 0);
+  }
+  if(e.size <= 0 && e.asize <= 0)
+    return;
+  if(!ests)
+    ests = es_init();
+  k = es_put(ests, d, &absent);
+  kh_val(ests, k) = e;
+}
+
+
+int64_t dir_mem_margin(struct dir *d, int asize) {
+  khint_t k;
+  if(!(d->flags & FF_EST) || !ests || (k = es_get(ests, d)) == kh_end(ests))
+    return 0;
+  return (int64_t)(1.96 * sqrt(asize ? kh_val(ests, k).asize : kh_val(ests, k).size));
+}
+
+
+void dir_mem_forget(struct dir *d, int top) {
+  struct dir *t;
+  struct est e;
+  khint_t k, kt;
+
+  if(!ests || (k = es_get(ests, d)) == kh_end(ests))
+    return;
+  e = kh_val(ests, k);
+  es_del(ests, k);
+  for(t=d->parent; top && t; t=t->parent)
+    if((kt = es_get(ests, t)) != kh_end(ests)) {
+      kh_val(ests, kt).size = kh_val(ests, kt).size > e.size ? kh_val(ests, kt).size - e.size : 0;
+      kh_val(ests, kt).asize = kh_val(ests, kt).asize > e.asize ? kh_val(ests, kt).asize - e.asize : 0;
+    }
 }
 
 
@@ -109,31 +283,96 @@ static void item_add(struct dir *item) {
 }
 
 
+/* Adds an item below --max-depth to the sizes of curdir, the deepest
+ * directory that is kept, without storing the item itself. A hard link is
+ * added to curdir and the parents that don't contain another link to the
+ * same file yet, which are those below the common parent with the last
+ * aggregated link (a) and with the stored links (b), as in hlink_check(). */
+static int aggregate(struct dir *dir, struct dir_ext *ext) {
+  struct dir *t, *a = NULL, *b = NULL;
+  struct agl key;
+  khint_t k;
+  int absent;
+
+  curdir->flags |= FF_AGGR;
+  if(dir->flags & FF_DIR)
+    skip++;
+
+  if(dir->flags & FF_HLNKC) {
+    key.dev = dir->dev;
+    key.ino = dir->ino;
+    k = ag_put(agl, key, &absent);
+    if(!absent)
+      a = getlca(curdir, kh_val(agl, k));
+    kh_val(agl, k) = curdir;
+    if((k = hl_get(links, dir)) != kh_end(links)) {
+      t = kh_key(links, k);
+      b = getlca(curdir, hlink_new(t) ? t : hlink_place(curdir, t));
+    }
+  }
+  addparentstats(curdir, 0, 0, extended_info && dir->flags & FF_EXT ? ext->mtime : 0, 1);
+  for(t=curdir; t && t!=a && t!=b; t=t->parent) {
+    t->size = adds64(t->size, dir->size);
+    t->asize = adds64(t->asize, dir->asize);
+  }
+
+  if(dir->flags & FF_SERR || dir->flags & FF_ERR)
+    for(t=curdir; t; t=t->parent)
+      t->flags |= FF_SERR;
+  if(dir->flags & FF_EST)
+    for(t=curdir; t && !(t->flags & FF_EST); t=t->parent)
+      t->flags |= FF_EST;
+
+  dir_output.size = root->size;
+  dir_output.items = root->items;
+  return 0;
+}
+
+
 static int item(struct dir *dir, const char *name, struct dir_ext *ext) {
   struct dir *t, *item;
 
   /* Go back to parent dir */
   if(!dir) {
+    if(skip) {
+      skip--;
+      return 0;
+    }
+    if(curdir->flags & FF_EST)
+      est_close(curdir);
     curdir = curdir->parent;
+    depth--;
     return 0;
   }
 
+  if(skip || (root && dir_mem_max_depth && depth >= dir_mem_max_depth))
+    return aggregate(dir, ext);
+
   if(!root && orig)
     name = orig->name;
 
   if(!extended_info)
     dir->flags &= ~FF_EXT;
-  item = xmalloc(dir->flags & FF_EXT ? dir_ext_memsize(name) : dir_memsize(name));
+  dir->flags &= ~FF_SHR;
+  if(dir->flags & FF_DIR)
+    dir->flags |= FF_SHR;
+  item = xmalloc(dir->flags & FF_SHR ? dir_shr_memsize(name, dir->flags) :
+    dir->flags & FF_EXT ? dir_ext_memsize(name) : dir_memsize(name));
   memcpy(item, dir, offsetof(struct dir, name));
   strcpy(item->name, name);
   if(dir->flags & FF_EXT)
     memcpy(dir_ext_ptr(item), ext, sizeof(struct dir_ext));
+  if(dir->flags & FF_SHR)
+    memset(dir_shr_ptr(item), 0, sizeof(struct dir_shr));
 
   item_add(item);
 
-  /* Ensure that any next items will go to this directory */
-  if(item->flags & FF_DIR)
+  /* Ensure that any next items will go to this directory. The roots under a
+   * virtual root are at depth 0 as well. */
+  if(item->flags & FF_DIR) {
     curdir = item;
+    depth = item != root ? depth+1 : item->flags & FF_VROOT ? -1 : 0;
+  }
 
   /* Special-case the name of the root item to be empty instead of "/". This is
    * what getpath() expects. */
@@ -157,6 +396,11 @@ static int item(struct dir *dir, const char *name, struct dir_ext *ext) {
     for(t=item->parent; t; t=t->parent)
       t->flags |= FF_SERR;
 
+  /* and estimates */
+  if(item->flags & FF_EST)
+    for(t=item->parent; t && !(t->flags & FF_EST); t=t->parent)
+      t->flags |= FF_EST;
+
   dir_output.size = root->size;
   dir_output.items = root->items;
 
@@ -164,9 +408,27 @@ static int item(struct dir *dir, const char *name, struct dir_ext *ext) {
 }
 
 
+struct dir *dir_mem_partial(void) {
+  return building ? root : NULL;
+}
+
+
+int dir_mem_counting(struct dir *d) {
+  struct dir *t;
+  for(t=curdir; building && t; t=t->parent)
+    if(t == d)
+      return 1;
+  return 0;
+}
+
+
 static int final(int fail) {
-  hl_destroy(links);
-  links = NULL;
+  int browsed = dir_browse;
+
+  building = dir_browse = 0;
+  if(agl)
+    ag_destroy(agl);
+  agl = NULL;
 
   if(fail) {
     freedir(root);
@@ -191,8 +453,16 @@ static int final(int fail) {
     freedir(orig);
   }
 
-  browse_init(root);
-  dirlist_top(-3);
+#if USE_WATCH
+  watch_add(root);
+#endif
+  /* Stay where the user was while browsing the partial tree */
+  if(browsed && dirlist_par)
+    browse_init(dirlist_par);
+  else {
+    browse_init(root);
+    dirlist_top(-3);
+  }
   return 0;
 }
 
@@ -200,6 +470,7 @@ static int final(int fail) {
 void dir_mem_init(struct dir *_orig) {
   orig = _orig;
   root = curdir = NULL;
+  building = !orig;
   pstate = ST_CALC;
 
   dir_output.item = item;
@@ -207,9 +478,10 @@ void dir_mem_init(struct dir *_orig) {
   dir_output.size = 0;
   dir_output.items = 0;
 
-  /* Init hash table for hard link detection */
-  links = hl_init();
-  if(orig)
-    hlink_init(getroot(orig));
+  if(!links)
+    links = hl_init();
+  if(dir_mem_max_depth)
+    agl = ag_init();
+  skip = 0;
 }
 
@@ -28,21 +28,52 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <sys/resource.h>
 
 #if HAVE_SYS_ATTR_H && HAVE_GETATTRLIST && HAVE_DECL_ATTR_CMNEXT_NOFIRMLINKPATH
 #include <sys/attr.h>
 #endif
 
-#if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
-#include <sys/statfs.h>
-#include <linux/magic.h>
+#if HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
 #endif
 
+#if HAVE_STATX && HAVE_SYS_SYSMACROS_H
+#define SCAN_STATX 1
+#endif
+
+#if HAVE_SYS_SYSCALL_H && HAVE_DECL_SYS_GETDENTS64
+#include <sys/syscall.h>
+#define SCAN_GETDENTS 1
+#endif
+
+#if HAVE_SYS_SYSCALL_H && HAVE_DECL_SYS_IOPRIO_SET
+#include <sys/syscall.h>
+#include <sched.h>
+#define SCAN_IDLE 1
+/* From linux/ioprio.h, which isn't always available */
+#define SCAN_IOPRIO_WHO_PROCESS 1
+#define SCAN_IOPRIO_CLASS_IDLE (3 << 13)
+#endif
+
+#if USE_URING && SCAN_STATX
+#define SCAN_URING 1
+#define SCAN_URING_SIZE 256
+#endif
+
+/* stat() latency histogram: 4 buckets per power of two */
+#define SCAN_HIST 256
+/* Number of stat() calls after which a worker flushes its counters */
+#define SCAN_FLUSH 4096
+
 
 /* set S_BLKSIZE if not defined already in sys/stat.h */
 #ifndef S_BLKSIZE
@@ -51,225 +82,704 @@
 
 
 int dir_scan_smfs; /* Stay on the same filesystem */
-
-static uint64_t curdev;   /* current device we're scanning on */
+int dir_scan_threads = 1; /* Number of threads to scan with */
+int dir_scan_uring; /* Use io_uring, if available */
+int dir_scan_inode_order = -1; /* Stat in inode order, -1 to detect */
+const char *dir_scan_incremental; /* Previous export to reuse unchanged directories from */
+const char *dir_scan_resume; /* Checkpoint of an interrupted scan to continue */
+int dir_scan_max_iops; /* Maximum number of file system operations per second, 0 for no limit */
+int dir_scan_idle; /* Scan with idle CPU and I/O priority */
+int dir_scan_estimate; /* Number of files to stat per directory, 0 to stat all */
+int dir_scan_breadth_first; /* Scan level by level instead of depth-first */
+
+struct dir_scan_top dir_scan_slowest[DIR_SCAN_TOP], dir_scan_largest[DIR_SCAN_TOP];
+int dir_scan_nslowest, dir_scan_nlargest;
+
+static char **roots;      /* directories given to dir_scan_init_roots() */
+static int nroots;        /* 0 for a single directory in dir_curpath */
 
 /* scratch space */
 static struct dir    *buf_dir;
 static struct dir_ext buf_ext[1];
 
 
-#if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
-int exclude_kernfs; /* Exclude Linux pseudo filesystems */
-
-static int is_kernfs(unsigned long type) {
-  if(
-#ifdef BINFMTFS_MAGIC
-     type == BINFMTFS_MAGIC ||
-#endif
-#ifdef BPF_FS_MAGIC
-     type == BPF_FS_MAGIC ||
-#endif
-#ifdef CGROUP_SUPER_MAGIC
-     type == CGROUP_SUPER_MAGIC ||
-#endif
-#ifdef CGROUP2_SUPER_MAGIC
-     type == CGROUP2_SUPER_MAGIC||
-#endif
-#ifdef DEBUGFS_MAGIC
-     type == DEBUGFS_MAGIC ||
-#endif
-#ifdef DEVPTS_SUPER_MAGIC
-     type == DEVPTS_SUPER_MAGIC ||
-#endif
-#ifdef PROC_SUPER_MAGIC
-     type == PROC_SUPER_MAGIC ||
-#endif
-#ifdef PSTOREFS_MAGIC
-     type == PSTOREFS_MAGIC ||
-#endif
-#ifdef SECURITYFS_MAGIC
-     type == SECURITYFS_MAGIC ||
-#endif
-#ifdef SELINUX_MAGIC
-     type == SELINUX_MAGIC ||
+/* The scanner works on one directory at a time: a directory is opened, all
+ * of its entries are read and stat()ed, and the results are kept in a struct
+ * scan_dir until they have been passed to dir_output. Every subdirectory that
+ * should be recursed into gets its own scan_dir, which is queued for scanning
+ * as soon as its parent has been read.
+ *
+ * Queued directories are distributed over a pool of worker threads. Each
+ * worker has its own deque: newly discovered subdirectories are pushed to and
+ * popped from the bottom, so that a single worker walks through the tree in
+ * depth-first order, while idle workers steal from the top of the other
+ * deques. The main thread is a worker as well, but its primary job is to walk
+ * through the finished directories in depth-first order and feed them to
+ * dir_output, so the output is the same regardless of the number of threads.
+ * With a single thread, the main thread simply scans each directory by itself
+ * right before it is needed.
+ *
+ * Directories are never entered with chdir(), all lookups are relative to an
+ * open directory descriptor. A scanned directory keeps its descriptor open
+ * until all of its subdirectories have been opened through it with openat(),
+ * as long as that fits within pool.maxfds. Directories whose parent could not
+ * keep its descriptor are opened by their full path instead.
+ */
+
+struct scan_dir;
+
+struct scan_item {
+  int64_t size, asize;
+  uint64_t ino, dev;
+  struct dir_ext ext;
+  struct scan_dir *sub; /* directory to recurse into, NULL otherwise */
+  size_t name;          /* offset into scan_dir->names */
+  unsigned short flags;
+  uint64_t dino;        /* d_ino from the directory listing */
+  unsigned char dtype;  /* d_type from the directory listing, 0 (DT_UNKNOWN) if not known */
+};
+
+#define SD_EOPEN 1 /* directory could not be opened, no items have been read */
+#define SD_EREAD 2 /* error while reading the directory, some items may be missing */
+
+struct scan_dir {
+  char *path;
+  const char *name;        /* name relative to parent, points into parent->names */
+  struct scan_dir *parent; /* NULL for the root */
+  int openfd;  /* descriptor opened in advance by the parent, or -1 */
+  int fd;      /* open descriptor for the subdirectories, or -1 */
+  int pending; /* number of subdirectories that still need fd, protected by pool.lock */
+  struct scan_item *items;
+  char *names;
+  int nitems;
+  int err;    /* SD_* error or 0 */
+  int errnum; /* errno of the error */
+  int done;   /* protected by pool.lock */
+  struct exclude_state *excl; /* match state of path, see exclude_dir() */
+  uint64_t rootdev; /* device of the root directory, for dir_scan_smfs */
+  int inode_order;  /* dir_scan_inode_order for the device of the root */
+  struct dir *cache; /* this directory in the previous scan, if any */
+  int reuse;         /* whether the items in cache are still valid */
+  int restore;       /* whether the whole directory is taken from cache, with --resume */
+  int marker;  /* whether the directory is excluded because of a marker file */
+  int rank;    /* index in ranks of the top-level entry this is in, or -1 */
+  int64_t ns, read_ns; /* time spent scanning the directory, and opening and reading it */
+};
+
+struct scan_ord {
+  uint64_t ino;
+  int idx;
+};
+
+struct scan_worker {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  struct scan_dir **list; /* deque of queued directories, [top..bottom) */
+  int size, top, bottom;
+  char *path;             /* scratch buffer for full paths of items */
+  size_t pathl;
+  struct scan_ord *ord;   /* scratch buffer for scan_order() */
+  int ordl;
+#if SCAN_URING
+  struct uring ring;      /* ring.fd is -1 if io_uring is not used */
+  struct statx *stx;      /* result buffers for in-flight statx() calls */
+  int *idx;               /* item index of each in-flight call */
 #endif
-#ifdef SYSFS_MAGIC
-     type == SYSFS_MAGIC ||
+#if SCAN_GETDENTS
+  char *dents;            /* getdents64() buffer, SCAN_DENTS_SIZE bytes */
 #endif
-#ifdef TRACEFS_MAGIC
-     type == TRACEFS_MAGIC ||
+  /* Performance counters, hist and busy are protected by lock and updated
+   * from the local copies by perf_flush() */
+  uint64_t hist[SCAN_HIST], lhist[SCAN_HIST];
+  int64_t busy, mark;     /* time spent scanning, and the start of the current period */
+  int lcount;             /* number of stat() calls in lhist */
+};
+
+static struct scan_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work; /* signalled when jobs are queued or on stop */
+  pthread_cond_t done; /* broadcast when a job has been finished */
+  pthread_cond_t stopped; /* broadcast on stop, for threads in scan_throttle() */
+  int queued;          /* number of jobs in all deques */
+  int fds, maxfds;     /* number of descriptors kept open by scan_dirs, and the limit */
+  int stop;
+  int n;               /* number of workers, w[0] is the main thread */
+  int main;            /* whether the main thread takes jobs */
+  int64_t next;        /* --max-iops: time at which the next operation may start */
+  uint64_t ops;        /* --max-iops: number of operations so far */
+  struct scan_worker *w;
+} pool;
+
+
+#define SCAN_BURST 100000000 /* ns worth of operations that may be done at once */
+
+static int64_t scan_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+
+/* Waits until n more file system operations fit in --max-iops. Each operation
+ * pushes pool.next forward by its share of a second, and we sleep for as far
+ * as pool.next runs ahead of the clock, minus a small burst allowance. The
+ * time spent sleeping doesn't count as busy time for w, if given. */
+static void scan_throttle(struct scan_worker *w, int n) {
+  struct timespec ts;
+  int64_t now, wait;
+
+  if(!dir_scan_max_iops)
+    return;
+
+  pthread_mutex_lock(&pool.lock);
+  now = scan_clock();
+  if(pool.next < now - SCAN_BURST)
+    pool.next = now - SCAN_BURST;
+  pool.next += (int64_t)n * 1000000000 / dir_scan_max_iops;
+  pool.ops += n;
+  wait = pool.next - now;
+
+  /* Sleep on a condition, so that pool_stop() can wake us up */
+  if(wait > 0) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += wait / 1000000000;
+    ts.tv_nsec += wait % 1000000000;
+    if(ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    while(!pool.stop && pthread_cond_timedwait(&pool.stopped, &pool.lock, &ts) != ETIMEDOUT)
+      ;
+    if(w)
+      w->mark += scan_clock() - now;
+  }
+  pthread_mutex_unlock(&pool.lock);
+}
+
+
+int dir_scan_rate(void) {
+  static uint64_t lastops;
+  static int64_t last;
+  static int rate;
+  int64_t now = scan_clock();
+  uint64_t ops;
+
+  if(!pool.w)
+    return 0;
+  pthread_mutex_lock(&pool.lock);
+  ops = pool.ops;
+  pthread_mutex_unlock(&pool.lock);
+
+  /* Average over at least a second */
+  if(ops < lastops)
+    lastops = 0;
+  if(now - last >= 1000000000) {
+    if(last)
+      rate = (int)((ops - lastops) * 1000000000 / (now - last));
+    lastops = ops;
+    last = now;
+  }
+  return rate;
+}
+
+
+#define TOP_KEY(t, slow) ((slow) ? (t).ns : (int64_t)(t).items)
+
+/* Adds a directory to one of the top lists. During the scan these are kept as
+ * min-heaps, so that the smallest entry can be replaced. */
+static void top_add(struct dir_scan_top *h, int *n, int slow, struct scan_dir *sd) {
+  struct dir_scan_top t;
+  int i, c;
+
+  t.ns = sd->ns;
+  t.read_ns = sd->read_ns;
+  t.items = sd->nitems;
+  if(*n == DIR_SCAN_TOP && TOP_KEY(t, slow) <= TOP_KEY(h[0], slow))
+    return;
+  t.path = xmalloc(strlen(sd->path)+1);
+  strcpy(t.path, sd->path);
+
+  if(*n < DIR_SCAN_TOP) {
+    /* sift up */
+    for(i=(*n)++; i>0 && TOP_KEY(t, slow) < TOP_KEY(h[(i-1)/2], slow); i=(i-1)/2)
+      h[i] = h[(i-1)/2];
+    h[i] = t;
+    return;
+  }
+
+  /* replace the smallest and sift down */
+  free(h[0].path);
+  for(i=0; (c = 2*i+1) < *n; i=c) {
+    if(c+1 < *n && TOP_KEY(h[c+1], slow) < TOP_KEY(h[c], slow))
+      c++;
+    if(TOP_KEY(t, slow) <= TOP_KEY(h[c], slow))
+      break;
+    h[i] = h[c];
+  }
+  h[i] = t;
+}
+
+
+static int top_cmp_slow(const void *a, const void *b) {
+  int64_t x = ((const struct dir_scan_top *)a)->ns, y = ((const struct dir_scan_top *)b)->ns;
+  return x > y ? -1 : x < y ? 1 : 0;
+}
+
+
+static int top_cmp_large(const void *a, const void *b) {
+  return ((const struct dir_scan_top *)b)->items - ((const struct dir_scan_top *)a)->items;
+}
+
+
+static void top_sort(void) {
+  qsort(dir_scan_slowest, dir_scan_nslowest, sizeof(struct dir_scan_top), top_cmp_slow);
+  qsort(dir_scan_largest, dir_scan_nlargest, sizeof(struct dir_scan_top), top_cmp_large);
+}
+
+
+/* --breadth-first: running totals of the entries in the root directory, or of
+ * the roots if there are several. Protected by pool.lock. */
+static struct dir_scan_rank *ranks;
+static int nranks, ranksz;
+
+static int rank_add(const char *name, int64_t size) {
+  if(nranks == ranksz) {
+    ranksz = ranksz ? ranksz*2 : 64;
+    ranks = xrealloc(ranks, ranksz*sizeof(struct dir_scan_rank));
+  }
+  ranks[nranks].name = name;
+  ranks[nranks].size = size;
+  return nranks++;
+}
+
+
+static int64_t cache_size(struct dir *);
+
+/* Size of an item, including the contents of a restored subdirectory */
+static int64_t rank_size(struct scan_item *it) {
+  return it->size + (it->sub && it->sub->restore ? cache_size(it->sub->cache) : 0);
+}
+
+
+/* Adds the items of a directory that has just been scanned to the totals,
+ * must be called before its subdirectories are queued. */
+static void rank_update(struct scan_dir *sd) {
+  int64_t size = 0;
+  int i, r;
+
+  if(!dir_scan_breadth_first)
+    return;
+  pthread_mutex_lock(&pool.lock);
+  if(!sd->parent && sd->rank < 0) {
+    for(i=0; i<sd->nitems; i++) {
+      r = rank_add(sd->names + sd->items[i].name, rank_size(sd->items+i));
+      if(sd->items[i].sub)
+        sd->items[i].sub->rank = r;
+    }
+  } else if(sd->rank >= 0) {
+    for(i=0; i<sd->nitems; i++)
+      size += rank_size(sd->items+i);
+    ranks[sd->rank].size += size;
+  }
+  pthread_mutex_unlock(&pool.lock);
+}
+
+
+int dir_scan_ranking(struct dir_scan_rank *r, int n) {
+  int i, j, c = 0;
+
+  if(!pool.w)
+    return 0;
+  pthread_mutex_lock(&pool.lock);
+  for(i=0; i<nranks; i++) {
+    for(j=c < n ? c++ : n; j > 0 && r[j-1].size < ranks[i].size; j--)
+      if(j < n)
+        r[j] = r[j-1];
+    if(j < n)
+      r[j] = ranks[i];
+  }
+  pthread_mutex_unlock(&pool.lock);
+  return c;
+}
+
+
+static void top_clear(void) {
+  int i;
+  for(i=0; i<dir_scan_nslowest; i++)
+    free(dir_scan_slowest[i].path);
+  for(i=0; i<dir_scan_nlargest; i++)
+    free(dir_scan_largest[i].path);
+  dir_scan_nslowest = dir_scan_nlargest = 0;
+}
+
+
+static int hist_bucket(int64_t ns) {
+  uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+  int e = 2;
+  if(v < 4)
+    return (int)v;
+  while(v >> (e+1))
+    e++;
+  return 4*(e-1) + (int)((v >> (e-2)) & 3);
+}
+
+
+/* Middle of the range of values in a bucket */
+static int64_t hist_value(int b) {
+  int e = b/4+1;
+  if(b < 4)
+    return b;
+  return ((int64_t)(4 + b%4) << (e-2)) + ((int64_t)1 << (e-2))/2;
+}
+
+
+static void perf_flush(struct scan_worker *w) {
+  int64_t now = scan_clock();
+  int i;
+
+  pthread_mutex_lock(&w->lock);
+  if(w->lcount)
+    for(i=0; i<SCAN_HIST; i++)
+      w->hist[i] += w->lhist[i];
+  w->busy += now - w->mark;
+  pthread_mutex_unlock(&w->lock);
+  if(w->lcount)
+    memset(w->lhist, 0, sizeof(w->lhist));
+  w->lcount = 0;
+  w->mark = now;
+}
+
+
+static void perf_stat(struct scan_worker *w, int64_t ns) {
+  w->lhist[hist_bucket(ns)]++;
+  if(++w->lcount == SCAN_FLUSH)
+    perf_flush(w);
+}
+
+
+static struct scan_perf {
+  uint64_t hist[SCAN_HIST]; /* sum of the worker histograms at the last update */
+  int64_t *busy, last;      /* busy time of each worker at the last update */
+  int *util;
+  struct dir_scan_perf cur;
+} perf;
+
+
+void dir_scan_perf(struct dir_scan_perf *p) {
+  uint64_t hist[SCAN_HIST], total = 0, sum = 0;
+  int64_t now = scan_clock(), busy;
+  int i, j;
+
+  if(!pool.w) {
+    memset(p, 0, sizeof(*p));
+    return;
+  }
+
+  pthread_mutex_lock(&pool.lock);
+  perf.cur.queued = pool.queued;
+  pthread_mutex_unlock(&pool.lock);
+
+  /* Update the figures at most once a second */
+  if(now - perf.last >= 1000000000) {
+    memset(hist, 0, sizeof(hist));
+    for(i=0; i<pool.n; i++) {
+      pthread_mutex_lock(&pool.w[i].lock);
+      for(j=0; j<SCAN_HIST; j++)
+        hist[j] += pool.w[i].hist[j];
+      busy = pool.w[i].busy;
+      pthread_mutex_unlock(&pool.w[i].lock);
+      perf.util[i] = (int)((busy - perf.busy[i]) * 100 / (now - perf.last));
+      if(perf.util[i] > 100)
+        perf.util[i] = 100;
+      perf.busy[i] = busy;
+    }
+
+    for(j=0; j<SCAN_HIST; j++) {
+      hist[j] -= perf.hist[j];
+      perf.hist[j] += hist[j];
+      total += hist[j];
+    }
+    perf.cur.p50 = perf.cur.p99 = 0;
+    for(j=0; j<SCAN_HIST && total; j++) {
+      sum += hist[j];
+      if(!perf.cur.p50 && sum*2 >= total)
+        perf.cur.p50 = hist_value(j);
+      if(sum*100 >= total*99) {
+        perf.cur.p99 = hist_value(j);
+        break;
+      }
+    }
+    perf.last = now;
+  }
+
+  /* Leave out the main thread if it doesn't scan */
+  perf.cur.n = pool.n - !pool.main;
+  perf.cur.util = perf.util + !pool.main;
+  *p = perf.cur;
+}
+
+
+/* Lowers the CPU and I/O priority of the calling thread for --idle */
+static void scan_idle(void) {
+#if SCAN_IDLE
+  struct sched_param sp = {0};
+  if(!dir_scan_idle)
+    return;
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp);
+  /* For IOPRIO_WHO_PROCESS, 0 refers to the calling thread */
+  syscall(SYS_ioprio_set, SCAN_IOPRIO_WHO_PROCESS, 0, SCAN_IOPRIO_CLASS_IDLE);
 #endif
-     0
-    )
-    return 1;
+}
+
+
+#if SCAN_STATX
+int fast_stat; /* Pass AT_STATX_DONT_SYNC to statx() */
+
+/* fstatat() replacement that only requests the fields we actually use, so
+ * that network filesystems don't have to revalidate everything else. Only
+ * the fields used by stat_to_item() are filled out. */
+static unsigned int scan_statx_mask(void) {
+  return STATX_TYPE|STATX_INO|STATX_NLINK|STATX_SIZE|STATX_BLOCKS
+    | (extended_info ? STATX_MODE|STATX_UID|STATX_GID|STATX_MTIME : 0);
+}
+
 
+static void statx_to_stat(struct statx *stx, struct stat *st) {
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_size = stx->stx_size;
+  st->st_blocks = stx->stx_blocks;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_mtime = stx->stx_mtime.tv_sec;
+}
+
+
+static int scan_stat(int fd, const char *name, struct stat *st, int flags) {
+  struct statx stx;
+
+  if(fast_stat)
+    flags |= AT_STATX_DONT_SYNC;
+  if(statx(fd, name, flags, scan_statx_mask(), &stx))
+    return -1;
+  statx_to_stat(&stx, st);
   return 0;
 }
+#else
+#define scan_stat fstatat
 #endif
 
-/* Populates the buf_dir and buf_ext with information from the stat struct.
- * Sets everything necessary for output_dir.item() except FF_ERR and FF_EXL. */
-static void stat_to_dir(struct stat *fs) {
-  buf_dir->flags |= FF_EXT; /* We always read extended data because it doesn't have an additional cost */
-  buf_dir->ino = (uint64_t)fs->st_ino;
-  buf_dir->dev = (uint64_t)fs->st_dev;
+
+/* Populates the scan_item with information from the stat struct.
+ * Sets everything necessary for output_dir.item() except FF_ERR and FF_EXL.
+ * rootdev is the device of the root directory being scanned. */
+static void stat_to_item(struct stat *fs, struct scan_item *it, uint64_t rootdev) {
+  it->flags |= FF_EXT; /* We always read extended data because it doesn't have an additional cost */
+  it->ino = (uint64_t)fs->st_ino;
+  it->dev = (uint64_t)fs->st_dev;
 
   if(S_ISREG(fs->st_mode))
-    buf_dir->flags |= FF_FILE;
+    it->flags |= FF_FILE;
   else if(S_ISDIR(fs->st_mode))
-    buf_dir->flags |= FF_DIR;
+    it->flags |= FF_DIR;
 
   if(!S_ISDIR(fs->st_mode) && fs->st_nlink > 1)
-    buf_dir->flags |= FF_HLNKC;
+    it->flags |= FF_HLNKC;
 
-  if(dir_scan_smfs && curdev != buf_dir->dev)
-    buf_dir->flags |= FF_OTHFS;
+  if(dir_scan_smfs && rootdev != it->dev)
+    it->flags |= FF_OTHFS;
 
-  if(!(buf_dir->flags & (FF_OTHFS|FF_EXL|FF_KERNFS))) {
-    buf_dir->size = fs->st_blocks * S_BLKSIZE;
-    buf_dir->asize = fs->st_size;
+  if(!(it->flags & (FF_OTHFS|FF_EXL|FF_KERNFS|FF_BNDMNT))) {
+    it->size = fs->st_blocks * S_BLKSIZE;
+    it->asize = fs->st_size;
   }
 
-  buf_ext->mode  = fs->st_mode;
-  buf_ext->mtime = fs->st_mtime;
-  buf_ext->uid   = (int)fs->st_uid;
-  buf_ext->gid   = (int)fs->st_gid;
+  it->ext.mode  = fs->st_mode;
+  it->ext.mtime = fs->st_mtime;
+  it->ext.uid   = (int)fs->st_uid;
+  it->ext.gid   = (int)fs->st_gid;
 }
 
 
-/* Reads all filenames in the currently chdir'ed directory and stores it as a
- * nul-separated list of filenames. The list ends with an empty filename (i.e.
- * two nuls). . and .. are not included. Returned memory should be freed. *err
- * is set to 1 if some error occurred. Returns NULL if that error was fatal.
- * The reason for reading everything in memory first and then walking through
- * the list is to avoid eating too many file descriptors in a deeply recursive
- * directory. */
-static char *dir_read(int *err) {
-  DIR *dir;
-  struct dirent *item;
-  char *buf = NULL;
-  size_t buflen = 512;
-  size_t off = 0;
+static struct scan_dir *scan_dir_new(const char *path) {
+  struct scan_dir *sd = xcalloc(1, sizeof(struct scan_dir));
+  sd->path = xmalloc(strlen(path)+1);
+  strcpy(sd->path, path);
+  sd->openfd = sd->fd = -1;
+  sd->rank = -1;
+  return sd;
+}
 
-  if((dir = opendir(".")) == NULL) {
-    *err = 1;
-    return NULL;
-  }
 
-  buf = xmalloc(buflen);
-  errno = 0;
+/* Frees a scan_dir, including any subdirectories that haven't been passed to
+ * dir_output. Must not be called while workers may still use them. */
+static void scan_dir_free(struct scan_dir *sd) {
+  int i;
+  for(i=0; i<sd->nitems; i++)
+    if(sd->items[i].sub)
+      scan_dir_free(sd->items[i].sub);
+  if(sd->openfd >= 0)
+    close(sd->openfd);
+  if(sd->fd >= 0)
+    close(sd->fd);
+  free(sd->items);
+  free(sd->names);
+  free(sd->path);
+  exclude_dir_free(sd->excl);
+  free(sd);
+}
 
-  while((item = readdir(dir)) != NULL) {
-    if(item->d_name[0] == '.' && (item->d_name[1] == 0 || (item->d_name[1] == '.' && item->d_name[2] == 0)))
-      continue;
-    size_t req = off+3+strlen(item->d_name);
-    if(req > buflen) {
-      buflen = req < buflen*2 ? buflen*2 : req;
-      buf = xrealloc(buf, buflen);
-    }
-    strcpy(buf+off, item->d_name);
-    off += strlen(item->d_name)+1;
+
+/* Growable list of names and items while reading a directory */
+struct dir_list {
+  size_t namesz, namel;
+  int itemsz;
+};
+
+
+static void dir_add(struct scan_dir *sd, struct dir_list *l, const char *name, uint64_t ino, unsigned char dtype) {
+  size_t len = strlen(name)+1;
+  struct scan_item *it;
+
+  if(name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+    return;
+
+  if(l->namel+len > l->namesz) {
+    l->namesz = l->namel+len < l->namesz*2 ? l->namesz*2 : l->namel+len;
+    sd->names = xrealloc(sd->names, l->namesz);
+  }
+  if(sd->nitems == l->itemsz) {
+    l->itemsz = l->itemsz ? l->itemsz*2 : 16;
+    sd->items = xrealloc(sd->items, l->itemsz*sizeof(struct scan_item));
   }
-  if(errno)
-    *err = 1;
-  if(closedir(dir) < 0)
-    *err = 1;
 
-  buf[off] = 0;
-  buf[off+1] = 0;
-  return buf;
+  it = sd->items + sd->nitems++;
+  memset(it, 0, sizeof(struct scan_item));
+  it->name = l->namel;
+  it->dino = ino;
+  it->dtype = dtype;
+  memcpy(sd->names+l->namel, name, len);
+  l->namel += len;
 }
 
 
-static int dir_walk(char *);
+#if SCAN_GETDENTS
 
+/* Large enough to read most directories in a single call */
+#define SCAN_DENTS_SIZE (256*1024)
 
-/* Tries to recurse into the current directory item (buf_dir is assumed to be the current dir) */
-static int dir_scan_recurse(const char *name) {
-  int fail = 0;
-  char *dir;
+struct scan_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
 
-  if(chdir(name)) {
-    dir_setlasterr(dir_curpath);
-    buf_dir->flags |= FF_ERR;
-    if(dir_output.item(buf_dir, name, buf_ext) || dir_output.item(NULL, 0, NULL)) {
-      dir_seterr("Output error: %s", strerror(errno));
-      return 1;
-    }
-    return 0;
-  }
+/* Reads the directory with getdents64(), returns -1 if the system call is not
+ * available and nothing has been read. */
+static int dir_read_dents(struct scan_worker *w, int fd, struct scan_dir *sd, struct dir_list *l) {
+  struct scan_dirent64 *ent;
+  long n, pos;
 
-  if((dir = dir_read(&fail)) == NULL) {
-    dir_setlasterr(dir_curpath);
-    buf_dir->flags |= FF_ERR;
-    if(dir_output.item(buf_dir, name, buf_ext) || dir_output.item(NULL, 0, NULL)) {
-      dir_seterr("Output error: %s", strerror(errno));
-      return 1;
+  if(!w->dents)
+    w->dents = xmalloc(SCAN_DENTS_SIZE);
+
+  while((n = syscall(SYS_getdents64, fd, w->dents, SCAN_DENTS_SIZE)) > 0)
+    for(pos=0; pos<n; pos+=ent->d_reclen) {
+      ent = (struct scan_dirent64 *)(w->dents+pos);
+      dir_add(sd, l, ent->d_name, ent->d_ino, ent->d_type);
     }
-    if(chdir("..")) {
-      dir_seterr("Error going back to parent directory: %s", strerror(errno));
-      return 1;
-    } else
-      return 0;
+
+  if(n < 0 && errno == ENOSYS && !sd->nitems)
+    return -1;
+  if(n < 0) {
+    sd->errnum = errno;
+    sd->err = SD_EREAD;
   }
+  return 0;
+}
 
-  /* readdir() failed halfway, not fatal. */
-  if(fail)
-    buf_dir->flags |= FF_ERR;
+#endif
 
-  if(dir_output.item(buf_dir, name, buf_ext)) {
-    dir_seterr("Output error: %s", strerror(errno));
-    return 1;
-  }
-  fail = dir_walk(dir);
-  if(dir_output.item(NULL, 0, NULL)) {
-    dir_seterr("Output error: %s", strerror(errno));
-    return 1;
+
+/* Reads all entries in the directory into sd->items, with their names in
+ * sd->names as a nul-separated list. . and .. are not included. fd is left
+ * open. Sets sd->err on error. */
+static void dir_read(struct scan_worker *w, int fd, struct scan_dir *sd) {
+  struct dir_list l = {0};
+  DIR *dir;
+  struct dirent *item;
+
+  scan_throttle(w, 1);
+#if SCAN_GETDENTS
+  if(dir_read_dents(w, fd, sd, &l) == 0)
+    goto done;
+#else
+  (void)w;
+#endif
+
+  if((fd = dup(fd)) < 0 || (dir = fdopendir(fd)) == NULL) {
+    sd->errnum = errno;
+    sd->err = SD_EOPEN;
+    if(fd >= 0)
+      close(fd);
+    return;
   }
 
-  /* Not being able to chdir back is fatal */
-  if(!fail && chdir("..")) {
-    dir_seterr("Error going back to parent directory: %s", strerror(errno));
-    return 1;
+  errno = 0;
+  while((item = readdir(dir)) != NULL)
+#if HAVE_STRUCT_DIRENT_D_TYPE
+    dir_add(sd, &l, item->d_name, (uint64_t)item->d_ino, item->d_type);
+#else
+    dir_add(sd, &l, item->d_name, (uint64_t)item->d_ino, 0);
+#endif
+  if(errno || closedir(dir) < 0) {
+    sd->errnum = errno;
+    sd->err = SD_EREAD;
   }
 
-  return fail;
+#if SCAN_GETDENTS
+done:
+#endif
+  if(!sd->items)
+    sd->items = xcalloc(1, sizeof(struct scan_item));
 }
 
 
-/* Scans and adds a single item. Recurses into dir_walk() again if this is a
- * directory. Assumes we're chdir'ed in the directory in which this item
- * resides. */
-static int dir_scan_item(const char *name) {
-  static struct stat st, stl;
-  int fail = 0;
-
+/* First part of scanning an item, returns non-zero if the item should be
+ * lstat()ed. */
+static int scan_item_check(struct scan_dir *sd, const char *name, char *path, struct scan_item *it) {
 #ifdef __CYGWIN__
   /* /proc/registry names may contain slashes */
-  if(strchr(name, '/') || strchr(name,  '\\')) {
-    buf_dir->flags |= FF_ERR;
-    dir_setlasterr(dir_curpath);
-  }
+  if(strchr(name, '/') || strchr(name,  '\\'))
+    it->flags |= FF_ERR;
+#else
+  (void)name;
 #endif
 
-  if(exclude_match(dir_curpath))
-    buf_dir->flags |= FF_EXL;
+  if(exclude_dir_match(sd->excl, path, name))
+    it->flags |= FF_EXL;
 
-  if(!(buf_dir->flags & (FF_ERR|FF_EXL)) && lstat(name, &st)) {
-    buf_dir->flags |= FF_ERR;
-    dir_setlasterr(dir_curpath);
-  }
+  return !(it->flags & (FF_ERR|FF_EXL));
+}
 
-#if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
-  if(exclude_kernfs && !(buf_dir->flags & (FF_ERR|FF_EXL)) && S_ISDIR(st.st_mode)) {
-    struct statfs fst;
-    if(statfs(name, &fst)) {
-      buf_dir->flags |= FF_ERR;
-      dir_setlasterr(dir_curpath);
-    } else if(is_kernfs(fst.f_type))
-      buf_dir->flags |= FF_KERNFS;
-  }
+
+/* Second part of scanning an item, given the result of lstat() in st, or
+ * FF_ERR if that failed. fd is sd, the directory the item resides in, and
+ * path is the full path to the item. Creates a new scan_dir in it->sub if this is a
+ * directory we should recurse into. */
+static void scan_item_stat(struct scan_dir *sd, int fd, const char *name, char *path, struct scan_item *it, struct stat *st) {
+  struct stat stl;
+
+#if USE_MOUNT
+  if(mount_active() && !(it->flags & (FF_ERR|FF_EXL)) && S_ISDIR(st->st_mode))
+    it->flags |= mount_exclude((uint64_t)st->st_dev, fd, name);
+  if(mount_binds() && !(it->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS)) && S_ISDIR(st->st_mode)
+      && !(dir_scan_smfs && (uint64_t)st->st_dev != sd->rootdev))
+    it->flags |= mount_bind(path);
 #endif
 
 #if HAVE_SYS_ATTR_H && HAVE_GETATTRLIST && HAVE_DECL_ATTR_CMNEXT_NOFIRMLINKPATH
@@ -283,118 +793,1247 @@ static int dir_scan_item(const char *name) {
       attrreference_t reference;
       char extra[PATH_MAX];
     } __attribute__((aligned(4), packed)) attributes;
-    if (getattrlist(name, &list, &attributes, sizeof(attributes), FSOPT_ATTR_CMN_EXTENDED) == -1) {
-      buf_dir->flags |= FF_ERR;
-      dir_setlasterr(dir_curpath);
-    } else if (strcmp(dir_curpath, (char *)&attributes.reference + attributes.reference.attr_dataoffset))
-      buf_dir->flags |= FF_FRMLNK;
+    if (getattrlistat(fd, name, &list, &attributes, sizeof(attributes), FSOPT_ATTR_CMN_EXTENDED) == -1)
+      it->flags |= FF_ERR;
+    else if (strcmp(path, (char *)&attributes.reference + attributes.reference.attr_dataoffset))
+      it->flags |= FF_FRMLNK;
+  }
+#endif
+
+  if(!(it->flags & (FF_ERR|FF_EXL))) {
+    if(follow_symlinks && S_ISLNK(st->st_mode)) {
+      scan_throttle(NULL, 1);
+      if(!scan_stat(fd, name, &stl, 0) && !S_ISDIR(stl.st_mode))
+        st = &stl;
+    }
+    stat_to_item(st, it, sd->rootdev);
+  }
+
+  if(it->flags & FF_DIR && !(it->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK|FF_BNDMNT)))
+    it->sub = scan_dir_new(path);
+}
+
+
+/* Scans and fills out a single item, see scan_item_stat() */
+static void scan_item(struct scan_worker *w, struct scan_dir *sd, int fd, const char *name, char *path, struct scan_item *it) {
+  struct stat st;
+  int64_t start;
+  if(scan_item_check(sd, name, path, it)) {
+    scan_throttle(w, 1);
+    start = scan_clock();
+    if(scan_stat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+      it->flags |= FF_ERR;
+    perf_stat(w, scan_clock() - start);
+  }
+  scan_item_stat(sd, fd, name, path, it, &st);
+}
+
+
+/* Sets w->path to the full path of the given item in sd */
+static char *scan_path(struct scan_worker *w, struct scan_dir *sd, const char *name) {
+  size_t l = strlen(sd->path), req = l+strlen(name)+2;
+  if(w->pathl < req) {
+    w->pathl = req < w->pathl*2 ? w->pathl*2 : req;
+    w->path = xrealloc(w->path, w->pathl);
+  }
+  strcpy(w->path, sd->path);
+  if(sd->path[1])
+    w->path[l++] = '/';
+  strcpy(w->path+l, name);
+  return w->path;
+}
+
+
+/* Opens the directory of a job, relative to its parent when the parent still
+ * has its descriptor. The parent's descriptor is closed once the last of its
+ * subdirectories has been opened. */
+static int scan_open(struct scan_worker *w, struct scan_dir *sd) {
+  struct scan_dir *par = sd->parent;
+  int fd, err, pfd = -1;
+
+  if(sd->openfd >= 0) {
+    fd = sd->openfd;
+    sd->openfd = -1;
+    pthread_mutex_lock(&pool.lock);
+    pool.fds--;
+    pthread_mutex_unlock(&pool.lock);
+    return fd;
+  }
+
+  scan_throttle(w, 1);
+  if(!par || par->fd < 0)
+    return path_open(sd->path);
+
+  fd = openat(par->fd, sd->name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+  err = errno;
+
+  pthread_mutex_lock(&pool.lock);
+  if(--par->pending == 0) {
+    pfd = par->fd;
+    par->fd = -1;
+    pool.fds--;
+  }
+  pthread_mutex_unlock(&pool.lock);
+
+  if(pfd >= 0)
+    close(pfd);
+  errno = err;
+  return fd;
+}
+
+
+static int scan_ord_cmp(const void *va, const void *vb) {
+  const struct scan_ord *a = va, *b = vb;
+  return a->ino < b->ino ? -1 : a->ino > b->ino ? 1 : 0;
+}
+
+
+/* Returns the order in which the items should be stat()ed, or NULL to use
+ * directory order. With inode_order, the items are sorted by the inode
+ * number from the directory listing, which on filesystems like ext4 and XFS
+ * roughly follows the location of the inode on disk. */
+static struct scan_ord *scan_order(struct scan_worker *w, struct scan_dir *sd) {
+  int i;
+
+  if(!sd->inode_order || sd->nitems < 2)
+    return NULL;
+  if(w->ordl < sd->nitems) {
+    w->ordl = sd->nitems;
+    w->ord = xrealloc(w->ord, w->ordl*sizeof(struct scan_ord));
+  }
+  for(i=0; i<sd->nitems; i++) {
+    w->ord[i].ino = sd->items[i].dino;
+    w->ord[i].idx = i;
+  }
+  qsort(w->ord, sd->nitems, sizeof(struct scan_ord), scan_ord_cmp);
+  return w->ord;
+}
+
+
+/* --estimate. Of the items in a directory that aren't directories according
+ * to the listing, only a random sample of dir_scan_estimate is stat()ed. The
+ * others get FF_EST and the mean size of the sample, and are not stat()ed at
+ * all. Directories without file types in the listing are scanned in full. */
+
+/* splitmix64 */
+static uint64_t scan_random(uint64_t *s) {
+  uint64_t z = (*s += UINT64_C(0x9e3779b97f4a7c15));
+  z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+  return z ^ (z >> 31);
+}
+
+
+/* Flags the items that are left out of the sample, returns whether there are
+ * any. The generator is seeded with the path, so that the same tree gives the
+ * same estimate regardless of the number of threads. */
+static int scan_sample(struct scan_worker *w, struct scan_dir *sd) {
+#ifdef DT_DIR
+  struct scan_item *it;
+  const char *name;
+  uint64_t seed = UINT64_C(0xcbf29ce484222325);
+  int i, n = 0, need = dir_scan_estimate, est = 0;
+
+  for(i=0; i<sd->nitems; i++) {
+    if(!sd->items[i].dtype)
+      return 0;
+    n += sd->items[i].dtype != DT_DIR;
+  }
+  if(n <= need)
+    return 0;
+
+  for(name=sd->path; *name; name++)
+    seed = (seed ^ (unsigned char)*name) * UINT64_C(0x100000001b3);
+
+  /* Selection sampling: each item is taken with a probability of the number
+   * of items that are still needed over the number of items left */
+  for(i=0; i<sd->nitems; i++) {
+    it = sd->items+i;
+    if(it->dtype == DT_DIR)
+      continue;
+    if(scan_random(&seed) % (uint64_t)n-- < (uint64_t)need) {
+      need--;
+      continue;
+    }
+    name = sd->names + it->name;
+    if(scan_item_check(sd, name, scan_path(w, sd, name), it)) {
+      it->flags |= FF_EST | (it->dtype == DT_REG ? FF_FILE : 0);
+      est = 1;
+    }
+  }
+  return est;
+#else
+  (void)w; (void)sd;
+  return 0;
+#endif
+}
+
+
+/* Gives the items that have been left out the mean size of the sample */
+static void scan_estimate(struct scan_dir *sd) {
+  struct scan_item *it;
+  int64_t size = 0, asize = 0, n = 0;
+  uint64_t dev = sd->rootdev;
+  int i;
+
+  for(i=0; i<sd->nitems; i++) {
+    it = sd->items+i;
+    if(!(it->flags & (FF_DIR|FF_EST|FF_ERR|FF_EXL))) {
+      size += it->size;
+      asize += it->asize;
+      dev = it->dev;
+      n++;
+    }
+  }
+  if(n) {
+    size = (size + n/2) / n;
+    asize = (asize + n/2) / n;
+  }
+  for(i=0; i<sd->nitems; i++) {
+    it = sd->items+i;
+    if(it->flags & FF_EST) {
+      it->size = size;
+      it->asize = asize;
+      it->dev = dev;
+    }
+  }
+}
+
+
+/* Incremental scanning. The previous scan is loaded into a tree of struct
+ * dir items, using the regular import code, before the scan starts. A
+ * directory whose inode and mtime haven't changed since the previous scan
+ * still has the same list of entries, so instead of reading and stat()ing
+ * everything, only its subdirectories are stat()ed again, while the sizes of
+ * the other items are taken from the cache. Files that have been modified in
+ * place will thus keep their old size, which is the price to pay for not
+ * stat()ing them.
+ *
+ * With --resume, the cache is the checkpoint of an interrupted scan instead.
+ * It ends within the directories that were being scanned, cache_open is the
+ * deepest of those. Every other directory in it had been scanned completely,
+ * these are restored as a whole without looking at the file system again. */
+
+static struct dir *cache_root, *cache_cur, *cache_open;
+static int resuming;
+
+static int process(void);
+
+
+static int cache_item(struct dir *dir, const char *name, struct dir_ext *ext) {
+  struct dir *t, *p, *n;
+
+  if(!dir) {
+    /* Items have been prepended, restore the original order */
+    for(p=NULL, t=cache_cur->sub; t; t=n) {
+      n = t->next;
+      t->next = p;
+      p = t;
+    }
+    cache_cur->sub = p;
+    if(dir_import_truncated && !cache_open)
+      cache_open = cache_cur;
+    cache_cur = cache_cur->parent;
+    return 0;
+  }
+
+  t = xmalloc(dir->flags & FF_EXT ? dir_ext_memsize(name) : dir_memsize(name));
+  memcpy(t, dir, offsetof(struct dir, name));
+  strcpy(t->name, name);
+  if(dir->flags & FF_EXT)
+    memcpy(dir_ext_ptr(t), ext, sizeof(struct dir_ext));
+  t->sub = NULL;
+  t->parent = cache_cur;
+  if(cache_cur) {
+    t->next = cache_cur->sub;
+    cache_cur->sub = t;
+  } else
+    cache_root = t;
+  if(t->flags & FF_DIR)
+    cache_cur = t;
+  dir_output.items++;
+  return 0;
+}
+
+
+static int cache_final(int fail) {
+  return fail;
+}
+
+
+static void cache_free(struct dir *d) {
+  struct dir *t, *n;
+  for(t=d->sub; t; t=n) {
+    n = t->next;
+    cache_free(t);
   }
+  free(d);
+}
+
+
+/* Loads dir_scan_incremental or dir_scan_resume into cache_root, returns
+ * non-zero on error */
+static int cache_load(void) {
+  struct dir_output out = dir_output;
+  const char *fn = dir_scan_resume ? dir_scan_resume : dir_scan_incremental;
+  char *path = xmalloc(strlen(dir_curpath)+1);
+  int r;
+
+  strcpy(path, dir_curpath);
+  cache_root = cache_cur = cache_open = NULL;
+  resuming = !!dir_scan_resume;
+  dir_import_partial = resuming;
+  if(dir_import_init(fn)) {
+    dir_seterr("Error opening %s: %s", fn, strerror(errno));
+    while(dir_fatalerr && !input_handle(0))
+      ;
+    r = 1;
+  } else {
+    dir_output.item = cache_item;
+    dir_output.final = cache_final;
+    dir_output.items = 0;
+    r = dir_process();
+  }
+
+  dir_output = out;
+  dir_process = process;
+  dir_import_active = 0;
+  dir_import_partial = dir_import_truncated = 0;
+  dir_curpath_set(path);
+  free(path);
+  if(r && cache_root) {
+    cache_free(cache_root);
+    cache_root = NULL;
+  }
+  return r;
+}
+
+
+/* Whether the cached directory c still has the same entries as the directory
+ * described by it. Directories modified in the same second as the previous
+ * scan started may have been changed after they were read, so these are
+ * scanned again. */
+static int cache_valid(struct dir *c, struct scan_item *it) {
+  return c && (c->flags & FF_DIR) && (c->flags & FF_EXT) && !(c->flags & (FF_ERR|FF_EXL))
+    && c->ino == it->ino && c->dev == it->dev
+    && dir_ext_ptr(c)->mtime == it->ext.mtime && it->ext.mtime < dir_import_timestamp;
+}
+
+
+static void cache_set(struct scan_dir *sd, struct dir *c, struct scan_item *it) {
+  if(c && (c->flags & FF_DIR)) {
+    sd->cache = c;
+    /* Excluded directories have no items to reuse */
+    sd->reuse = !resuming && !(c->flags & FF_EXL) && cache_valid(c, it);
+  }
+}
+
+
+/* Whether a subdirectory can be restored from the checkpoint. Directories that
+ * were excluded or had an error are scanned again. */
+static int cache_restore(struct scan_dir *sd, struct scan_item *it) {
+  struct dir *t, *c = sd->cache;
+
+  if(!resuming || !c || c->flags & (FF_ERR|FF_EXL) || c->ino != it->ino || c->dev != it->dev)
+    return 0;
+  for(t=cache_open; t; t=t->parent)
+    if(t == c)
+      return 0;
+  return 1;
+}
+
+
+static int64_t cache_size(struct dir *c) {
+  int64_t size = 0;
+  struct dir *t;
+  for(t=c->sub; t; t=t->next)
+    size += t->size + cache_size(t);
+  return size;
+}
+
+
+static int cache_cmp(const void *key, const void *elem) {
+  return strcmp((const char *)key, (*(struct dir **)elem)->name);
+}
+
+static int cache_sort(const void *a, const void *b) {
+  return strcmp((*(struct dir **)a)->name, (*(struct dir **)b)->name);
+}
+
+
+/* Looks up the cached subdirectories of a directory that has been read again */
+static void cache_attach(struct scan_dir *sd) {
+  struct dir **list, **c, *t;
+  int i, n = 0;
+
+  for(t=sd->cache->sub; t; t=t->next)
+    if(t->flags & FF_DIR)
+      n++;
+  if(!n)
+    return;
+
+  list = xmalloc(n*sizeof(struct dir *));
+  for(n=0, t=sd->cache->sub; t; t=t->next)
+    if(t->flags & FF_DIR)
+      list[n++] = t;
+  qsort(list, n, sizeof(struct dir *), cache_sort);
+
+  for(i=0; i<sd->nitems; i++)
+    if(sd->items[i].sub && (c = bsearch(sd->names + sd->items[i].name, list, n, sizeof(struct dir *), cache_cmp)) != NULL)
+      cache_set(sd->items[i].sub, *c, sd->items+i);
+  free(list);
+}
+
+
+/* Checks the listing of a subdirectory for marker files, before any of its
+ * items are scanned. If one is found, the items are dropped and the directory
+ * will be output as excluded. */
+static int scan_marker(int fd, struct scan_dir *sd) {
+  int i;
+
+  if(!exclude_markers() || !sd->parent)
+    return 0;
+  for(i=0; i<sd->nitems; i++)
+    if(exclude_marker(fd, sd->names + sd->items[i].name))
+      break;
+  if(i == sd->nitems)
+    return 0;
+
+  sd->nitems = 0;
+  sd->err = 0;
+  sd->marker = 1;
+  return 1;
+}
+
+
+/* Fills out the items of an unchanged directory from the cache. Directories,
+ * and items that were excluded or had an error, are scanned again. */
+static void scan_dir_cached(struct scan_worker *w, int fd, struct scan_dir *sd) {
+  struct dir_list l = {0};
+  struct scan_item *it;
+  struct dir *c;
+  const char *name;
+  char *path;
+  int i;
+
+  for(c=sd->cache->sub; c; c=c->next)
+    dir_add(sd, &l, c->name, c->ino, 0);
+  if(!sd->items)
+    sd->items = xcalloc(1, sizeof(struct scan_item));
+  if(scan_marker(fd, sd))
+    return;
+
+  for(i=0, c=sd->cache->sub; c; i++, c=c->next) {
+    it = sd->items+i;
+    name = sd->names + it->name;
+    path = scan_path(w, sd, name);
+    if(c->flags & (FF_DIR|FF_ERR|FF_EXL)) {
+      scan_item(w, sd, fd, name, path, it);
+      if(it->sub)
+        cache_set(it->sub, c, it);
+    } else if(scan_item_check(sd, name, path, it)) {
+      it->size = c->size;
+      it->asize = c->asize;
+      it->ino = c->ino;
+      it->dev = c->dev;
+      it->flags = c->flags & ~(FF_BSEL|FF_SERR|FF_SHR);
+      if(c->flags & FF_EXT)
+        it->ext = *dir_ext_ptr(c);
+    }
+  }
+}
+
+
+#if SCAN_URING
+
+/* Same as calling scan_item() on every item, but with the lstat() calls
+ * submitted in batches through io_uring. */
+static void scan_items_uring(struct scan_worker *w, int fd, struct scan_dir *sd, struct scan_ord *ord) {
+  struct io_uring_sqe *sqe;
+  struct scan_item *it;
+  struct stat st;
+  const char *name;
+  uint64_t k;
+  int64_t start, lat;
+  int i = 0, j, n, res;
+
+  while(i < sd->nitems) {
+    if(w->ring.fd < 0) {
+      it = sd->items + (ord ? ord[i].idx : i);
+      name = sd->names + it->name;
+      if(!(it->flags & FF_EST))
+        scan_item(w, sd, fd, name, scan_path(w, sd, name), it);
+      i++;
+      continue;
+    }
+
+    for(n=0; i<sd->nitems && n<(int)w->ring.entries; i++) {
+      j = ord ? ord[i].idx : i;
+      it = sd->items+j;
+      name = sd->names + it->name;
+      if(it->flags & FF_EST)
+        continue;
+      if(!scan_item_check(sd, name, scan_path(w, sd, name), it)) {
+        scan_item_stat(sd, fd, name, w->path, it, &st);
+        continue;
+      }
+      /* Submit what we have when the ring is full, stat the item ourselves
+       * if there is nothing to submit */
+      if(!(sqe = uring_sqe(&w->ring))) {
+        if(n)
+          break;
+        if(scan_stat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+          it->flags |= FF_ERR;
+        scan_item_stat(sd, fd, name, w->path, it, &st);
+        continue;
+      }
+      sqe->opcode = IORING_OP_STATX;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t)(uintptr_t)name;
+      sqe->len = scan_statx_mask();
+      sqe->off = (uint64_t)(uintptr_t)(w->stx+n);
+      sqe->statx_flags = AT_SYMLINK_NOFOLLOW | (fast_stat ? AT_STATX_DONT_SYNC : 0);
+      sqe->user_data = n;
+      w->idx[n++] = j;
+    }
+    if(!n)
+      continue;
+
+    start = scan_clock();
+    if(uring_wait(&w->ring)) {
+      /* Give up on io_uring and do the stat calls ourselves, uring_free()
+       * first waits for those that the kernel is still working on */
+      uring_free(&w->ring);
+      for(k=0; k<(uint64_t)n; k++) {
+        it = sd->items+w->idx[k];
+        name = sd->names + it->name;
+        if(scan_stat(fd, name, &st, AT_SYMLINK_NOFOLLOW))
+          it->flags |= FF_ERR;
+        scan_item_stat(sd, fd, name, scan_path(w, sd, name), it, &st);
+      }
+      continue;
+    }
+    /* The latency of a batch is spread over its calls */
+    lat = (scan_clock() - start) / n;
+
+    while(uring_cqe(&w->ring, &k, &res)) {
+      perf_stat(w, lat);
+      it = sd->items+w->idx[k];
+      name = sd->names + it->name;
+      if(res < 0)
+        it->flags |= FF_ERR;
+      else
+        statx_to_stat(w->stx+k, &st);
+      scan_item_stat(sd, fd, name, scan_path(w, sd, name), it, &st);
+    }
+  }
+}
+
+
+/* Opens the subdirectories of sd through io_uring, as far as the descriptor
+ * budget allows. Returns the number of subdirectories that have been opened,
+ * the others will be opened by their own job. */
+static int scan_open_uring(struct scan_worker *w, int fd, struct scan_dir *sd, int subs) {
+  struct io_uring_sqe *sqe;
+  uint64_t k;
+  int i = 0, n, r, res, avail, opened = 0;
+
+  pthread_mutex_lock(&pool.lock);
+  avail = pool.maxfds - pool.fds;
+  if(avail > subs)
+    avail = subs;
+  if(avail > 0)
+    pool.fds += avail;
+  pthread_mutex_unlock(&pool.lock);
+  if(avail <= 0)
+    return 0;
+
+  while(i < sd->nitems && opened < avail && w->ring.fd >= 0) {
+    for(n=0; i<sd->nitems && n<(int)w->ring.entries && opened+n < avail; i++) {
+      if(!sd->items[i].sub || sd->items[i].sub->restore)
+        continue;
+      /* The others are left to their own job if nothing fits */
+      if(!(sqe = uring_sqe(&w->ring)))
+        break;
+      sqe->opcode = IORING_OP_OPENAT;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t)(uintptr_t)sd->items[i].sub->name;
+      sqe->open_flags = O_RDONLY|O_DIRECTORY|O_NOFOLLOW;
+      sqe->user_data = i;
+      n++;
+    }
+    if(!n)
+      break;
+    r = uring_wait(&w->ring);
+    if(r)
+      uring_drain(&w->ring);
+    while(uring_cqe(&w->ring, &k, &res))
+      if(res >= 0) {
+        sd->items[k].sub->openfd = res;
+        opened++;
+      }
+    if(r) {
+      uring_free(&w->ring);
+      break;
+    }
+  }
+
+  /* Release what we didn't use */
+  if(opened < avail) {
+    pthread_mutex_lock(&pool.lock);
+    pool.fds -= avail - opened;
+    pthread_mutex_unlock(&pool.lock);
+  }
+  return opened;
+}
+
 #endif
 
-  if(!(buf_dir->flags & (FF_ERR|FF_EXL))) {
-    if(follow_symlinks && S_ISLNK(st.st_mode) && !stat(name, &stl) && !S_ISDIR(stl.st_mode))
-      stat_to_dir(&stl);
+
+static void pool_push(struct scan_worker *, struct scan_dir *);
+
+/* Reads and scans all items in a directory, queueing its subdirectories */
+static void scan_dir(struct scan_worker *w, struct scan_dir *sd) {
+  struct scan_ord *ord;
+  int fd, i, j, keep = 0, queued = 0, pending, est;
+  int64_t start = scan_clock();
+
+  if((fd = scan_open(w, sd)) < 0) {
+    sd->errnum = errno;
+    sd->err = SD_EOPEN;
+    sd->ns = sd->read_ns = scan_clock() - start;
+    return;
+  }
+
+  if(sd->reuse)
+    scan_dir_cached(w, fd, sd);
+  else {
+    dir_read(w, fd, sd);
+    sd->read_ns = scan_clock() - start;
+    if(sd->err == SD_EOPEN || scan_marker(fd, sd)) {
+      sd->ns = sd->read_ns;
+      close(fd);
+      return;
+    }
+
+    est = dir_scan_estimate && scan_sample(w, sd);
+    ord = scan_order(w, sd);
+#if SCAN_URING
+    if(w->ring.fd >= 0)
+      scan_items_uring(w, fd, sd, ord);
     else
-      stat_to_dir(&st);
+#endif
+    for(i=0; i<sd->nitems; i++) {
+      struct scan_item *it = sd->items + (ord ? ord[i].idx : i);
+      const char *name = sd->names + it->name;
+      if(!(it->flags & FF_EST))
+        scan_item(w, sd, fd, name, scan_path(w, sd, name), it);
+    }
+    if(est)
+      scan_estimate(sd);
+    if(sd->cache)
+      cache_attach(sd);
   }
+  sd->ns = scan_clock() - start;
+
+  for(i=0; i<sd->nitems; i++)
+    if(sd->items[i].sub) {
+      sd->items[i].sub->parent = sd;
+      sd->items[i].sub->name = sd->names + sd->items[i].name;
+      sd->items[i].sub->excl = exclude_dir(sd->excl, sd->items[i].sub->name);
+      sd->items[i].sub->rootdev = sd->rootdev;
+      sd->items[i].sub->inode_order = sd->inode_order;
+      sd->items[i].sub->rank = sd->rank;
+      /* Nothing to scan, the job is done before it would have been queued */
+      if(cache_restore(sd->items[i].sub, sd->items+i))
+        sd->items[i].sub->restore = sd->items[i].sub->done = 1;
+      else
+        queued++;
+    }
+  pending = queued;
+  rank_update(sd);
 
-  if(cachedir_tags && (buf_dir->flags & FF_DIR) && !(buf_dir->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)))
-    if(has_cachedir_tag(name)) {
-      buf_dir->flags |= FF_EXL;
-      buf_dir->size = buf_dir->asize = 0;
+#if SCAN_URING
+  if(queued && w->ring.fd >= 0)
+    pending -= scan_open_uring(w, fd, sd, queued);
+#endif
+
+  /* Keep the descriptor around for our subdirectories if we can */
+  if(pending) {
+    pthread_mutex_lock(&pool.lock);
+    if(pool.fds < pool.maxfds) {
+      pool.fds++;
+      keep = 1;
     }
+    pthread_mutex_unlock(&pool.lock);
+  }
+  if(keep) {
+    sd->fd = fd;
+    sd->pending = pending;
+  } else
+    close(fd);
+
+  /* Queue in reverse order, so that the first subdirectory is popped first.
+   * Breadth-first, jobs are taken from the other end. */
+  for(i=0; i<sd->nitems; i++) {
+    j = dir_scan_breadth_first ? i : sd->nitems-1-i;
+    if(sd->items[j].sub && !sd->items[j].sub->restore)
+      pool_push(w, sd->items[j].sub);
+  }
 
-  /* Recurse into the dir or output the item */
-  if(buf_dir->flags & FF_DIR && !(buf_dir->flags & (FF_ERR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK)))
-    fail = dir_scan_recurse(name);
-  else if(buf_dir->flags & FF_DIR) {
-    if(dir_output.item(buf_dir, name, buf_ext) || dir_output.item(NULL, 0, NULL)) {
-      dir_seterr("Output error: %s", strerror(errno));
-      fail = 1;
+  if(queued) {
+    pthread_mutex_lock(&pool.lock);
+    pool.queued += queued;
+    if(queued > 1)
+      pthread_cond_broadcast(&pool.work);
+    else
+      pthread_cond_signal(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+  }
+}
+
+
+static void pool_push(struct scan_worker *w, struct scan_dir *sd) {
+  pthread_mutex_lock(&w->lock);
+  if(w->bottom == w->size) {
+    if(w->top > w->size/2) {
+      memmove(w->list, w->list+w->top, (w->bottom-w->top)*sizeof(*w->list));
+      w->bottom -= w->top;
+      w->top = 0;
+    } else {
+      w->size = w->size ? w->size*2 : 64;
+      w->list = xrealloc(w->list, w->size*sizeof(*w->list));
     }
-  } else if(dir_output.item(buf_dir, name, buf_ext)) {
-    dir_seterr("Output error: %s", strerror(errno));
-    fail = 1;
   }
+  w->list[w->bottom++] = sd;
+  pthread_mutex_unlock(&w->lock);
+}
+
+
+/* Takes a job from the bottom of our own deque or, if that's empty, steals
+ * one from the top of another. Breadth-first, our own deque is a queue. */
+static struct scan_dir *pool_take(struct scan_worker *w) {
+  struct scan_dir *sd = NULL;
+  struct scan_worker *o;
+  int i;
+
+  pthread_mutex_lock(&w->lock);
+  if(w->top < w->bottom)
+    sd = dir_scan_breadth_first ? w->list[w->top++] : w->list[--w->bottom];
+  if(w->top == w->bottom)
+    w->top = w->bottom = 0;
+  pthread_mutex_unlock(&w->lock);
+
+  for(i=1; !sd && i<pool.n; i++) {
+    o = pool.w + ((w - pool.w) + i) % pool.n;
+    pthread_mutex_lock(&o->lock);
+    if(o->top < o->bottom)
+      sd = o->list[o->top++];
+    if(o->top == o->bottom)
+      o->top = o->bottom = 0;
+    pthread_mutex_unlock(&o->lock);
+  }
+
+  if(sd) {
+    pthread_mutex_lock(&pool.lock);
+    pool.queued--;
+    pthread_mutex_unlock(&pool.lock);
+  }
+  return sd;
+}
+
+
+static void pool_run(struct scan_worker *w, struct scan_dir *sd) {
+  w->mark = scan_clock();
+  scan_dir(w, sd);
+  perf_flush(w);
+  pthread_mutex_lock(&pool.lock);
+  top_add(dir_scan_slowest, &dir_scan_nslowest, 1, sd);
+  top_add(dir_scan_largest, &dir_scan_nlargest, 0, sd);
+  sd->done = 1;
+  pthread_cond_broadcast(&pool.done);
+  pthread_mutex_unlock(&pool.lock);
+}
+
+
+static void *pool_thread(void *arg) {
+  struct scan_worker *w = arg;
+  struct scan_dir *sd;
+  int stop;
+
+  scan_idle();
+  while(1) {
+    pthread_mutex_lock(&pool.lock);
+    while(!pool.stop && !pool.queued)
+      pthread_cond_wait(&pool.work, &pool.lock);
+    stop = pool.stop;
+    pthread_mutex_unlock(&pool.lock);
+    if(stop)
+      break;
+    if((sd = pool_take(w)) != NULL)
+      pool_run(w, sd);
+  }
+  return NULL;
+}
+
+
+static void pool_start(void) {
+  struct rlimit rl;
+  int i;
+
+  /* When throttled, all scanning is done by separate threads so that the
+   * main thread stays responsive */
+  pool.main = !dir_scan_max_iops && !dir_scan_idle;
+  /* At least one worker for each root */
+  pool.n = (dir_scan_threads > nroots ? dir_scan_threads : nroots > 1 ? nroots : 1) + !pool.main;
+  pool.w = xcalloc(pool.n, sizeof(struct scan_worker));
+  pool.queued = pool.stop = pool.fds = 0;
+  pool.next = 0;
+  pool.ops = 0;
+
+  /* Use at most half of the available descriptors for open directories, the
+   * workers need a few of their own and so does the output. */
+  if(getrlimit(RLIMIT_NOFILE, &rl))
+    pool.maxfds = 256;
+  else if(rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > 65536)
+    pool.maxfds = 32768;
+  else
+    pool.maxfds = (int)rl.rlim_cur/2 - 4*pool.n;
+  if(pool.maxfds < 0)
+    pool.maxfds = 0;
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.work, NULL);
+  pthread_cond_init(&pool.done, NULL);
+  pthread_cond_init(&pool.stopped, NULL);
+
+  for(i=0; i<pool.n; i++) {
+    pthread_mutex_init(&pool.w[i].lock, NULL);
+#if SCAN_URING
+    {
+      static const int ops[] = { IORING_OP_STATX, IORING_OP_OPENAT };
+      /* Batches don't mix well with --max-iops */
+      if(!dir_scan_uring || dir_scan_max_iops || uring_init(&pool.w[i].ring, SCAN_URING_SIZE, ops, 2))
+        pool.w[i].ring.fd = -1;
+      else {
+        pool.w[i].stx = xmalloc(pool.w[i].ring.entries * sizeof(struct statx));
+        pool.w[i].idx = xmalloc(pool.w[i].ring.entries * sizeof(int));
+      }
+    }
+#endif
+  }
+  for(i=1; i<pool.n; i++)
+    if(pthread_create(&pool.w[i].thread, NULL, pool_thread, pool.w+i)) {
+      /* Continue with the threads we've got. */
+      pool.n = i;
+      break;
+    }
+  if(pool.n == 1)
+    pool.main = 1;
+
+  memset(&perf, 0, sizeof(perf));
+  perf.last = scan_clock();
+  perf.busy = xcalloc(pool.n, sizeof(int64_t));
+  perf.util = xcalloc(pool.n, sizeof(int));
+}
+
 
-  return fail || input_handle(1);
+/* Stops and waits for all worker threads. Any jobs left in the queues are
+ * owned by their parent scan_dir and are freed along with it. */
+static void pool_stop(void) {
+  int i;
+
+  pthread_mutex_lock(&pool.lock);
+  pool.stop = 1;
+  pthread_cond_broadcast(&pool.work);
+  pthread_cond_broadcast(&pool.stopped);
+  pthread_mutex_unlock(&pool.lock);
+
+  for(i=1; i<pool.n; i++)
+    pthread_join(pool.w[i].thread, NULL);
+  for(i=0; i<pool.n; i++) {
+    pthread_mutex_destroy(&pool.w[i].lock);
+    free(pool.w[i].list);
+    free(pool.w[i].path);
+    free(pool.w[i].ord);
+#if SCAN_URING
+    if(pool.w[i].ring.fd >= 0)
+      uring_free(&pool.w[i].ring);
+    free(pool.w[i].stx);
+    free(pool.w[i].idx);
+#endif
+#if SCAN_GETDENTS
+    free(pool.w[i].dents);
+#endif
+  }
+  free(perf.busy);
+  free(perf.util);
+  pthread_cond_destroy(&pool.stopped);
+  pthread_cond_destroy(&pool.done);
+  pthread_cond_destroy(&pool.work);
+  pthread_mutex_destroy(&pool.lock);
+  free(pool.w);
+  pool.w = NULL;
+  pool.n = 0;
 }
 
 
-/* Walks through the directory that we're currently chdir'ed to. *dir contains
- * the filenames as returned by dir_read(), and will be freed automatically by
- * this function. */
-static int dir_walk(char *dir) {
-  int fail = 0;
-  char *cur;
+/* Waits until the given directory has been scanned, meanwhile scanning other
+ * queued directories and handling user input. Returns non-zero when the user
+ * aborted the scan. */
+static int pool_wait(struct scan_dir *sd) {
+  struct scan_dir *t;
+  struct timespec ts;
+  int done;
 
-  fail = 0;
-  for(cur=dir; !fail&&cur&&*cur; cur+=strlen(cur)+1) {
-    dir_curpath_enter(cur);
+  while(1) {
+    pthread_mutex_lock(&pool.lock);
+    done = sd->done;
+    pthread_mutex_unlock(&pool.lock);
+    if(done)
+      return 0;
+
+    if(pool.main && (t = pool_take(pool.w)) != NULL)
+      pool_run(pool.w, t);
+    else {
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += update_delay / 1000;
+      ts.tv_nsec += (update_delay % 1000) * 1000000;
+      if(ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_mutex_lock(&pool.lock);
+      if(!sd->done)
+        pthread_cond_timedwait(&pool.done, &pool.lock, &ts);
+      pthread_mutex_unlock(&pool.lock);
+    }
+    dir_checkpoint_check();
+    if(input_handle(1))
+      return 1;
+  }
+}
+
+
+static void item_to_buf(struct scan_item *it) {
+  memset(buf_dir, 0, offsetof(struct dir, name));
+  buf_dir->size = it->size;
+  buf_dir->asize = it->asize;
+  buf_dir->ino = it->ino;
+  buf_dir->dev = it->dev;
+  buf_dir->flags = it->flags;
+  *buf_ext = it->ext;
+}
+
+
+#if HAVE_SYS_SYSMACROS_H
+/* Returns whether the block device backing dev is rotational, according to
+ * sysfs. Partitions don't have a queue directory of their own, so we also
+ * look at their parent device. */
+static int dev_rotational(uint64_t dev) {
+  char path[64], buf[4] = "";
+  FILE *f;
+
+  snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/rotational", (unsigned)major(dev), (unsigned)minor(dev));
+  if((f = fopen(path, "r")) == NULL) {
+    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/rotational", (unsigned)major(dev), (unsigned)minor(dev));
+    f = fopen(path, "r");
+  }
+  if(f == NULL)
+    return 0;
+  if(!fgets(buf, sizeof(buf), f))
+    buf[0] = 0;
+  fclose(f);
+  return buf[0] == '1';
+}
+#else
+#define dev_rotational(dev) 0
+#endif
+
+
+static int scan_emit(struct scan_dir *);
+
+/* Passes the items of a restored directory to dir_output */
+static int cache_emit(struct dir *c) {
+  static int n;
+  struct dir *t;
+
+  for(t=c->sub; t; t=t->next) {
+    dir_curpath_enter(t->name);
     memset(buf_dir, 0, offsetof(struct dir, name));
-    memset(buf_ext, 0, sizeof(struct dir_ext));
-    fail = dir_scan_item(cur);
+    buf_dir->size = t->size;
+    buf_dir->asize = t->asize;
+    buf_dir->ino = t->ino;
+    buf_dir->dev = t->dev;
+    buf_dir->flags = t->flags & ~(FF_BSEL|FF_SERR);
+    if(t->flags & FF_EXT)
+      *buf_ext = *dir_ext_ptr(t);
+    if(t->flags & FF_ERR)
+      dir_setlasterr(dir_curpath);
+
+    if(dir_output.item(buf_dir, t->name, buf_ext)) {
+      dir_seterr("Output error: %s", strerror(errno));
+      return 1;
+    }
+    if(t->flags & FF_DIR) {
+      if(cache_emit(t))
+        return 1;
+      if(dir_output.item(NULL, 0, NULL)) {
+        dir_seterr("Output error: %s", strerror(errno));
+        return 1;
+      }
+    }
     dir_curpath_leave();
+    /* As with importing, input_handle() would dominate if called for each item */
+    if(!(++n & 31) && input_handle(1))
+      return 1;
   }
+  return 0;
+}
 
-  free(dir);
-  return fail;
+
+/* Passes a single item to dir_output, recursing into its subdirectory if it
+ * has one. */
+static int emit_item(struct scan_dir *sd, struct scan_item *it) {
+  const char *name = sd->names + it->name;
+  struct scan_dir *sub = it->sub;
+
+  dir_curpath_enter(name);
+
+  if(sub && pool_wait(sub))
+    return 1;
+
+  if(sub && sub->marker) {
+    it->flags |= FF_EXL;
+    it->size = it->asize = 0;
+  }
+  item_to_buf(it);
+  if(sub && sub->err)
+    buf_dir->flags |= FF_ERR;
+  if(buf_dir->flags & FF_ERR)
+    dir_setlasterr(dir_curpath);
+
+  if(dir_output.item(buf_dir, name, buf_ext)) {
+    dir_seterr("Output error: %s", strerror(errno));
+    return 1;
+  }
+  if(sub && sub->err != SD_EOPEN && (sub->restore ? cache_emit(sub->cache) : scan_emit(sub)))
+    return 1;
+  if(it->flags & FF_DIR && dir_output.item(NULL, 0, NULL)) {
+    dir_seterr("Output error: %s", strerror(errno));
+    return 1;
+  }
+
+  if(sub) {
+    scan_dir_free(sub);
+    it->sub = NULL;
+  }
+  dir_curpath_leave();
+  return input_handle(1);
 }
 
 
-static int process(void) {
-  char *path;
-  char *dir;
-  int fail = 0;
-  struct stat fs;
+/* Passes all items of a scanned directory to dir_output */
+static int scan_emit(struct scan_dir *sd) {
+  int i;
+  for(i=0; i<sd->nitems; i++)
+    if(emit_item(sd, sd->items+i))
+      return 1;
+  return 0;
+}
 
-  memset(buf_dir, 0, offsetof(struct dir, name));
-  memset(buf_ext, 0, sizeof(struct dir_ext));
 
-  if((path = path_real(dir_curpath)) == NULL)
+/* Resolves a root directory and creates its scan_dir. Returns NULL after
+ * dir_seterr() if it can't be scanned. */
+static struct scan_dir *root_open(const char *path, struct scan_item *root) {
+  struct scan_dir *sd;
+  struct dir *c;
+  struct stat fs;
+  char *real;
+
+  dir_curpath_set(path);
+  if((real = path_real(path)) == NULL) {
     dir_seterr("Error obtaining full path: %s", strerror(errno));
-  else {
-    dir_curpath_set(path);
-    free(path);
+    return NULL;
   }
+  dir_curpath_set(real);
+  free(real);
 
-  if(!dir_fatalerr && path_chdir(dir_curpath) < 0)
-    dir_seterr("Error changing directory: %s", strerror(errno));
-
-  /* Can these even fail after a chdir? */
-  if(!dir_fatalerr && lstat(".", &fs) != 0)
+  if(lstat(dir_curpath, &fs) != 0) {
     dir_seterr("Error obtaining directory information: %s", strerror(errno));
-  if(!dir_fatalerr && !S_ISDIR(fs.st_mode))
+    return NULL;
+  }
+  if(!S_ISDIR(fs.st_mode)) {
     dir_seterr("Not a directory");
+    return NULL;
+  }
+
+  memset(root, 0, sizeof(struct scan_item));
+  stat_to_item(&fs, root, (uint64_t)fs.st_dev);
+  sd = scan_dir_new(dir_curpath);
+  sd->rootdev = root->dev;
+  sd->inode_order = dir_scan_inode_order >= 0 ? dir_scan_inode_order : dev_rotational(root->dev);
+  sd->excl = exclude_dir(NULL, dir_curpath);
+  if(nroots && dir_scan_breadth_first) {
+    pthread_mutex_lock(&pool.lock);
+    sd->rank = rank_add(sd->path, root->size);
+    pthread_mutex_unlock(&pool.lock);
+  }
+
+  /* A previous scan of multiple roots has them under a virtual root */
+  c = cache_root;
+  if(c && c->flags & FF_VROOT)
+    for(c=c->sub; c && strcmp(c->name, dir_curpath) != 0; c=c->next)
+      ;
+  else if(c && strcmp(c->name, dir_curpath) != 0)
+    c = NULL;
+  cache_set(sd, c, root);
+#if USE_MOUNT
+  mount_root(dir_curpath);
+#endif
+  return sd;
+}
+
+
+/* Passes a root directory and its contents to dir_output, except for the
+ * closing of the directory */
+static int root_emit(struct scan_dir *sd, struct scan_item *root) {
+  dir_curpath_set(sd->path);
+  if(pool_wait(sd))
+    return 1;
+  if(sd->err == SD_EOPEN) {
+    dir_seterr("Error reading directory: %s", strerror(sd->errnum));
+    return 1;
+  }
+
+  if(sd->err)
+    root->flags |= FF_ERR;
+  item_to_buf(root);
+  if(dir_output.item(buf_dir, dir_curpath, buf_ext)) {
+    dir_seterr("Output error: %s", strerror(errno));
+    return 1;
+  }
+  return scan_emit(sd);
+}
 
-  if(!dir_fatalerr && !(dir = dir_read(&fail)))
-    dir_seterr("Error reading directory: %s", strerror(errno));
 
+/* Passes the virtual directory that holds multiple roots to dir_output. Its
+ * name lists the roots, the size fields are left to the output. */
+static int vroot_emit(void) {
+  size_t len = 0;
+  char *name;
+  int i, r;
+
+  for(i=0; i<nroots; i++)
+    len += strlen(roots[i])+2;
+  name = xmalloc(len);
+  *name = 0;
+  for(i=0; i<nroots; i++) {
+    if(i)
+      strcat(name, ", ");
+    strcat(name, roots[i]);
+  }
+
+  memset(buf_dir, 0, offsetof(struct dir, name));
+  buf_dir->flags = FF_DIR|FF_VROOT;
+  if((r = dir_output.item(buf_dir, name, NULL)) != 0)
+    dir_seterr("Output error: %s", strerror(errno));
+  free(name);
+  return r;
+}
+
+
+static int process(void) {
+  int fail = 0, i, n = nroots ? nroots : 1;
+  struct scan_dir **sd = xcalloc(n, sizeof(struct scan_dir *));
+  struct scan_item *root = xcalloc(n, sizeof(struct scan_item));
+  char *path = xmalloc(strlen(dir_curpath)+1);
+
+  /* The cache is only used for the initial scan, not for refreshes */
+  if(dir_scan_incremental || dir_scan_resume) {
+    fail = cache_load();
+    dir_scan_incremental = dir_scan_resume = NULL;
+    if(fail) {
+      free(sd);
+      free(root);
+      free(path);
+      return dir_output.final(1);
+    }
+  }
+
+  /* All roots are queued before any of them is passed to the output, so that
+   * they are scanned concurrently. They are all opened before the first one is
+   * queued, the bind mount decisions depend on the full set of roots. */
+  strcpy(path, dir_curpath);
+  top_clear();
+  nranks = 0;
+#if USE_MOUNT
+  mount_init();
+#endif
+  pool_start();
+  for(i=0; i<n && !dir_fatalerr; i++)
+    sd[i] = root_open(nroots ? roots[i] : path, root+i);
+  free(path);
+  for(i=0; i<n && !dir_fatalerr; i++)
+    pool_push(pool.w, sd[i]);
   if(!dir_fatalerr) {
-    curdev = (uint64_t)fs.st_dev;
-    if(fail)
-      buf_dir->flags |= FF_ERR;
-    stat_to_dir(&fs);
+    pthread_mutex_lock(&pool.lock);
+    pool.queued += n;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.lock);
+  }
 
-    if(dir_output.item(buf_dir, dir_curpath, buf_ext)) {
+  if(!dir_fatalerr && nroots)
+    fail = vroot_emit();
+  for(i=0; i<n && !dir_fatalerr && !fail; i++) {
+    fail = root_emit(sd[i], root+i);
+    /* Roots under the virtual root are closed here, a single one below */
+    if(!fail && nroots && dir_output.item(NULL, 0, NULL)) {
       dir_seterr("Output error: %s", strerror(errno));
       fail = 1;
     }
-    if(!fail)
-      fail = dir_walk(dir);
-    if(!fail && dir_output.item(NULL, 0, NULL)) {
+  }
+  /* Everything has been scanned, the output may want the top lists */
+  if(!dir_fatalerr && !fail) {
+    top_sort();
+    if(dir_output.item(NULL, 0, NULL)) {
       dir_seterr("Output error: %s", strerror(errno));
       fail = 1;
     }
   }
 
+  pool_stop();
+  top_sort();
+  /* Only the initial scan is estimated, refreshing a directory scans it in full */
+  dir_scan_estimate = 0;
+  for(i=0; i<n; i++)
+    if(sd[i])
+      scan_dir_free(sd[i]);
+  free(sd);
+  free(root);
+  if(cache_root) {
+    cache_free(cache_root);
+    cache_root = cache_open = NULL;
+  }
+  resuming = 0;
+
   while(dir_fatalerr && !input_handle(0))
     ;
   return dir_output.final(dir_fatalerr || fail);
 }
 
 
+static void roots_free(void) {
+  int i;
+  for(i=0; i<nroots; i++)
+    free(roots[i]);
+  free(roots);
+  roots = NULL;
+  nroots = 0;
+}
+
+
 void dir_scan_init(const char *path) {
+  roots_free();
   dir_curpath_set(path);
   dir_setlasterr(NULL);
   dir_seterr(NULL);
@@ -403,3 +2042,21 @@ void dir_scan_init(const char *path) {
     buf_dir = xmalloc(dir_memsize(""));
   pstate = ST_CALC;
 }
+
+
+void dir_scan_init_roots(char **paths, int n) {
+  int i;
+
+  dir_scan_init(paths[0]);
+  if(n < 2)
+    return;
+  /* path_real() changes the cwd, so relative roots are made absolute before
+   * the first of them is resolved */
+  roots = xmalloc(n*sizeof(char *));
+  for(i=0; i<n; i++)
+    if((roots[i] = path_absolute(paths[i])) == NULL) {
+      roots[i] = xmalloc(strlen(paths[i])+1);
+      strcpy(roots[i], paths[i]);
+    }
+  nroots = n;
+}
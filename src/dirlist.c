@@ -59,6 +59,16 @@ static inline int cmp_mtime(struct dir *x, struct dir*y) {
   return (x_mtime > y_mtime ? 1 : (x_mtime == y_mtime ? 0 : -1));
 }
 
+/* compares the shared sizes, or with excl the exclusive sizes */
+static inline int cmp_shared(struct dir *x, struct dir *y, int asize, int excl) {
+  int64_t xs = getshared(x, asize), ys = getshared(y, asize);
+  if(excl) {
+    xs = (asize ? x->asize : x->size) - xs;
+    ys = (asize ? y->asize : y->size) - ys;
+  }
+  return (xs > ys ? 1 : (xs == ys ? 0 : -1));
+}
+
 static int dirlist_cmp(struct dir *x, struct dir *y) {
   int r;
 
@@ -76,6 +86,7 @@ static int dirlist_cmp(struct dir *x, struct dir *y) {
    *   SIZE: size  -> asize -> name  -> items
    *  ASIZE: asize -> size  -> name  -> items
    *  ITEMS: items -> size  -> asize -> name
+   *   EXCL: excl  -> size  -> name  -> items  (and likewise for the others)
    *
    * Note that the method used below is supposed to be fast, not readable :-)
    */
@@ -89,7 +100,9 @@ static int dirlist_cmp(struct dir *x, struct dir *y) {
       dirlist_sort_col == DL_COL_SIZE ? CMP_SIZE :
       dirlist_sort_col == DL_COL_ASIZE ? CMP_ASIZE :
       dirlist_sort_col == DL_COL_ITEMS ? CMP_ITEMS :
-      cmp_mtime(x, y);
+      dirlist_sort_col == DL_COL_MTIME ? cmp_mtime(x, y) :
+      cmp_shared(x, y, dirlist_sort_col == DL_COL_AEXCL || dirlist_sort_col == DL_COL_ASHARED,
+        dirlist_sort_col == DL_COL_EXCL || dirlist_sort_col == DL_COL_AEXCL);
   /* try 2 */
   if(!r)
     r = dirlist_sort_col == DL_COL_SIZE ? CMP_ASIZE : CMP_SIZE;
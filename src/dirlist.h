@@ -38,6 +38,10 @@
 #define DL_COL_ASIZE   2
 #define DL_COL_ITEMS   3
 #define DL_COL_MTIME   4
+#define DL_COL_EXCL    5
+#define DL_COL_AEXCL   6
+#define DL_COL_SHARED  7
+#define DL_COL_ASHARED 8
 
 
 void dirlist_open(struct dir *);
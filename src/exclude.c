@@ -29,25 +29,394 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fnmatch.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
 
+#include <khashl.h>
+
+
+/* The patterns are compiled into a matcher when they are added, so that the
+ * cost of exclude_match() doesn't grow with the number of patterns. A pattern
+ * matches a path if it matches the full path or any part of it that starts
+ * after a slash, as if fnmatch() was tried on each of those.
+ *
+ * - Literal patterns ("node_modules", "a/b") and patterns with only a leading
+ *   star ("*.o") are stored reversed in a trie, which is walked once from the
+ *   end of the path.
+ * - Patterns with only a trailing star ("build*") are stored in a forward
+ *   trie, walked from the start of each path component.
+ * - All other patterns are combined into a single bit-parallel automaton,
+ *   with one state per pattern position. Bracket expressions and '?' operate
+ *   on bytes, so for paths with non-ASCII bytes the patterns that have them
+ *   are checked with fnmatch() instead, which knows about the locale.
+ * - Patterns the automaton doesn't support ([=a=], [.a.], non-ASCII ranges)
+ *   are always checked with fnmatch().
+ */
 
 static struct exclude {
   char *pattern;
   struct exclude *next;
-} *excludes = NULL;
+} *excludes = NULL, **excludes_end = &excludes;
 
+/* Whether the matcher below has been built from all patterns in excludes. It
+ * is built when the first directory is matched, which happens before the scan
+ * starts any threads, so that adding N patterns doesn't build it N times. */
+static int matcher_built = 0;
 
 
-void exclude_add(char *pat) {
-  struct exclude **n;
+/* Edges are stored in a hash table, indexed by (node << 8) | character */
+KHASHL_MAP_INIT(KH_LOCAL, edge_t, edge, uint64_t, uint32_t, kh_hash_uint64, kh_eq_generic)
+
+#define TRIE_WORD 1 /* a literal ends here, which has to start at a path component */
+#define TRIE_ANY  2 /* a literal ends here, which can start anywhere */
+
+static struct trie {
+  edge_t *edges;
+  unsigned char *flags;
+  uint32_t n, size;
+} rtrie, ftrie;
+
+/* The automaton, in bit sets of nwords words */
+static int nwords;
+static uint64_t *nfa_match; /* 256 sets, states that advance on a character */
+static uint64_t *nfa_star;  /* states at a star, which loop on any character */
+static uint64_t *nfa_start; /* initial states, including what a leading star skips to */
+static uint64_t *nfa_end;   /* final states */
+static uint64_t *nfa_ascii; /* final states of patterns that only work on ASCII paths */
+
+/* Patterns for fnmatch(), always and for paths with non-ASCII bytes */
+static char **fnm_all, **fnm_mb;
+static int nfnm_all, nfnm_mb;
+
+
+#define ATOM_CHAR 0
+#define ATOM_SET  1
+#define ATOM_STAR 2
+
+struct atom {
+  int type;
+  unsigned char c;
+  unsigned char set[32];
+};
 
-  n = &excludes;
-  while(*n != NULL)
-    n = &((*n)->next);
 
-  *n = (struct exclude *) xcalloc(1, sizeof(struct exclude));
-  (*n)->pattern = (char *) xmalloc(strlen(pat)+1);
-  strcpy((*n)->pattern, pat);
+static void trie_init(struct trie *t) {
+  t->edges = edge_init();
+  t->size = 64;
+  t->n = 1;
+  t->flags = xcalloc(t->size, 1);
+}
+
+
+static void trie_free(struct trie *t) {
+  if(t->edges)
+    edge_destroy(t->edges);
+  free(t->flags);
+  memset(t, 0, sizeof(struct trie));
+}
+
+
+static void trie_add(struct trie *t, const struct atom *a, int n, int step, int flag) {
+  uint32_t node = 0;
+  khint_t k;
+  int i, absent;
+
+  for(i=0; i<n; i++) {
+    k = edge_put(t->edges, ((uint64_t)node << 8) | a[step > 0 ? i : n-1-i].c, &absent);
+    if(absent) {
+      if(t->n == t->size) {
+        t->size *= 2;
+        t->flags = xrealloc(t->flags, t->size);
+      }
+      t->flags[t->n] = 0;
+      kh_val(t->edges, k) = t->n++;
+    }
+    node = kh_val(t->edges, k);
+  }
+  t->flags[node] |= flag;
+}
+
+
+static uint32_t trie_next(struct trie *t, uint32_t node, unsigned char c) {
+  khint_t k = edge_get(t->edges, ((uint64_t)node << 8) | c);
+  return k == kh_end(t->edges) ? 0 : kh_val(t->edges, k);
+}
+
+
+/* Whether a pattern may start at path+i, see exclude_match() */
+#define COMPONENT(path, i) ((i) == 0 || ((path)[(i)-1] == '/' && (path)[i] != '/'))
+
+
+/* Parses a bracket expression at *p (just after the '['), into a->set.
+ * Returns 0 if this is not a valid expression, in which case the '[' is taken
+ * literally, and -1 if it uses something we don't support. */
+static int parse_set(const char **p, struct atom *a) {
+  static const struct { const char *name; int (*f)(int); } classes[] = {
+    { "alnum", isalnum }, { "alpha", isalpha }, { "blank", isblank }, { "cntrl", iscntrl },
+    { "digit", isdigit }, { "graph", isgraph }, { "lower", islower }, { "print", isprint },
+    { "punct", ispunct }, { "space", isspace }, { "upper", isupper }, { "xdigit", isxdigit },
+  };
+  const char *s = *p, *e;
+  int neg = 0, first = 1, lo, hi, i;
+
+  memset(a->set, 0, sizeof(a->set));
+  a->type = ATOM_SET;
+  if(*s == '!' || *s == '^') {
+    neg = 1;
+    s++;
+  }
+
+  for(; *s && (first || *s != ']'); first = 0) {
+    if(*s == '[' && (s[1] == '=' || s[1] == '.'))
+      return -1;
+    if(*s == '[' && s[1] == ':') {
+      if((e = strstr(s+2, ":]")) == NULL)
+        return 0;
+      for(i=0; i<(int)(sizeof(classes)/sizeof(*classes)); i++)
+        if(strlen(classes[i].name) == (size_t)(e-s-2) && strncmp(classes[i].name, s+2, e-s-2) == 0)
+          break;
+      if(i == sizeof(classes)/sizeof(*classes))
+        return -1;
+      for(lo=0; lo<128; lo++)
+        if(classes[i].f(lo))
+          a->set[lo/8] |= 1<<(lo%8);
+      s = e+2;
+      continue;
+    }
+
+    if(*s == '\\' && s[1])
+      s++;
+    lo = (unsigned char)*s++;
+    hi = lo;
+    if(*s == '-' && s[1] && s[1] != ']') {
+      s++;
+      if(*s == '\\' && s[1])
+        s++;
+      hi = (unsigned char)*s++;
+    }
+    /* Ranges beyond ASCII depend on the locale */
+    if(lo != hi && (lo >= 128 || hi >= 128))
+      return -1;
+    for(; lo<=hi; lo++)
+      a->set[lo/8] |= 1<<(lo%8);
+  }
+  if(*s != ']')
+    return 0;
+
+  if(neg)
+    for(i=0; i<32; i++)
+      a->set[i] = ~a->set[i];
+  *p = s+1;
+  return 1;
+}
+
+
+/* Parses a pattern into atoms, with consecutive stars merged. Returns the
+ * number of atoms, or -1 if the pattern can't be compiled. Sets *sens if the
+ * pattern has atoms that match single bytes rather than characters. */
+static int parse(const char *p, struct atom *a, int *sens) {
+  const char *s;
+  int n = 0;
+
+  *sens = 0;
+  while(*p) {
+    if(*p == '*') {
+      p++;
+      if(!n || a[n-1].type != ATOM_STAR)
+        a[n++].type = ATOM_STAR;
+      continue;
+    }
+    if(*p == '?') {
+      p++;
+      a[n].type = ATOM_SET;
+      memset(a[n++].set, 0xff, 32);
+      *sens = 1;
+      continue;
+    }
+    if(*p == '[') {
+      s = p+1;
+      switch(parse_set(&s, a+n)) {
+      case -1: return -1;
+      case 1:
+        p = s;
+        n++;
+        *sens = 1;
+        continue;
+      }
+    }
+    if(*p == '\\') {
+      if(!p[1])
+        return -1;
+      p++;
+    }
+    a[n].type = ATOM_CHAR;
+    a[n++].c = (unsigned char)*p++;
+  }
+  return n;
+}
+
+
+static void set_bit(uint64_t *set, int bit) {
+  set[bit/64] |= (uint64_t)1 << (bit%64);
+}
+
+
+/* Adds the atoms to the automaton, as states base..base+n */
+static void nfa_add(const struct atom *a, int n, int base, int sens) {
+  int i, c;
+
+  set_bit(nfa_start, base);
+  if(a[0].type == ATOM_STAR)
+    set_bit(nfa_start, base+1);
+  set_bit(nfa_end, base+n);
+  if(sens)
+    set_bit(nfa_ascii, base+n);
+
+  for(i=0; i<n; i++) {
+    if(a[i].type == ATOM_STAR)
+      set_bit(nfa_star, base+i);
+    else
+      for(c=0; c<256; c++)
+        if(a[i].type == ATOM_CHAR ? a[i].c == c : a[i].set[c/8] & (1<<(c%8)))
+          set_bit(nfa_match + c*nwords, base+i);
+  }
+}
+
+
+/* Where a compiled pattern goes */
+#define PAT_FNM 0 /* fnmatch() */
+#define PAT_LIT 1 /* literal, rtrie */
+#define PAT_SUF 2 /* star and a literal, rtrie */
+#define PAT_PRE 3 /* literal and a star, ftrie */
+#define PAT_NFA 4
+
+static int classify(const struct atom *a, int n, int sens) {
+  int i, stars = 0;
+
+  if(n < 0)
+    return PAT_FNM;
+  if(sens)
+    return PAT_NFA;
+  for(i=0; i<n; i++)
+    if(a[i].type == ATOM_STAR)
+      stars++;
+  if(!stars)
+    return PAT_LIT;
+  if(stars == 1 && a[0].type == ATOM_STAR)
+    return PAT_SUF;
+  if(stars == 1 && a[n-1].type == ATOM_STAR)
+    return PAT_PRE;
+  return PAT_NFA;
+}
+
+
+static void fnm_add(char ***list, int *n, const char *pat) {
+  *list = xrealloc(*list, (*n+1)*sizeof(char *));
+  (*list)[*n] = xmalloc(strlen(pat)+1);
+  strcpy((*list)[(*n)++], pat);
+}
+
+
+static void matcher_free(void) {
+  int i;
+
+  trie_free(&rtrie);
+  trie_free(&ftrie);
+  free(nfa_match);
+  free(nfa_star);
+  free(nfa_start);
+  free(nfa_end);
+  free(nfa_ascii);
+  nfa_match = nfa_star = nfa_start = nfa_end = nfa_ascii = NULL;
+  nwords = 0;
+  for(i=0; i<nfnm_all; i++)
+    free(fnm_all[i]);
+  for(i=0; i<nfnm_mb; i++)
+    free(fnm_mb[i]);
+  free(fnm_all);
+  free(fnm_mb);
+  fnm_all = fnm_mb = NULL;
+  nfnm_all = nfnm_mb = 0;
+}
+
+
+/* Rebuilds the matcher from the list of patterns */
+static void matcher_build(void) {
+  struct exclude *e;
+  struct atom *a = NULL;
+  size_t asize = 0;
+  int n, sens, states = 0, pass;
+
+  matcher_free();
+  trie_init(&rtrie);
+  trie_init(&ftrie);
+
+  /* The first pass counts the states of the automaton, the second fills it */
+  for(pass=0; pass<2; pass++) {
+    if(pass && states) {
+      nwords = (states+63)/64;
+      nfa_match = xcalloc(256*nwords, sizeof(uint64_t));
+      nfa_star  = xcalloc(nwords, sizeof(uint64_t));
+      nfa_start = xcalloc(nwords, sizeof(uint64_t));
+      nfa_end   = xcalloc(nwords, sizeof(uint64_t));
+      nfa_ascii = xcalloc(nwords, sizeof(uint64_t));
+      states = 0;
+    }
+    for(e=excludes; e; e=e->next) {
+      if(asize < strlen(e->pattern)+1) {
+        asize = strlen(e->pattern)+1;
+        a = xrealloc(a, asize*sizeof(struct atom));
+      }
+      n = parse(e->pattern, a, &sens);
+      switch(classify(a, n, sens)) {
+      case PAT_FNM:
+        if(pass)
+          fnm_add(&fnm_all, &nfnm_all, e->pattern);
+        break;
+      case PAT_LIT:
+        if(pass)
+          trie_add(&rtrie, a, n, -1, TRIE_WORD);
+        break;
+      case PAT_SUF:
+        if(pass)
+          trie_add(&rtrie, a+1, n-1, -1, TRIE_ANY);
+        break;
+      case PAT_PRE:
+        if(pass)
+          trie_add(&ftrie, a, n-1, 1, TRIE_WORD);
+        break;
+      case PAT_NFA:
+        if(pass) {
+          nfa_add(a, n, states, sens);
+          if(sens)
+            fnm_add(&fnm_mb, &nfnm_mb, e->pattern);
+        }
+        states += n+1;
+        break;
+      }
+    }
+  }
+  free(a);
+}
+
+
+static void matcher_update(void) {
+  if(!matcher_built)
+    matcher_build();
+  matcher_built = 1;
+}
+
+
+void exclude_add(char *pat) {
+  struct exclude *n;
+
+  n = (struct exclude *) xcalloc(1, sizeof(struct exclude));
+  n->pattern = (char *) xmalloc(strlen(pat)+1);
+  strcpy(n->pattern, pat);
+  *excludes_end = n;
+  excludes_end = &n->next;
+  matcher_built = 0;
 }
 
 
@@ -73,23 +442,278 @@ int exclude_addfile(char *file) {
 }
 
 
-int exclude_match(char *path) {
-  struct exclude *n;
-  char *c;
+/* Matches a pattern against the path and every part of it that starts after
+ * a slash */
+static int fnmatch_path(const char *pat, const char *path) {
+  const char *c;
+
+  if(!fnmatch(pat, path, 0))
+    return 1;
+  for(c = path; *c; c++)
+    if(*c == '/' && c[1] != '/' && !fnmatch(pat, c+1, 0))
+      return 1;
+  return 0;
+}
+
+
+/* Match state after a part of a path. Directories keep the state of their own
+ * path, so that only the name of each item has to be fed to the matcher. */
+struct exclude_state {
+  int prev;       /* last byte fed, -1 at the start of the path */
+  int ascii;      /* whether no byte >= 128 was fed */
+  int all;        /* a prefix pattern has matched, so everything below does */
+  int nlive;
+  uint32_t *live; /* forward trie nodes that can still be reached */
+  uint64_t *d;    /* automaton states, nwords words */
+};
+
+
+/* Upper bound on the number of forward trie walks that feeding str may add */
+static int state_walks(const char *str) {
+  int n = 1;
+  while((str = strchr(str, '/')) != NULL) {
+    str++;
+    n++;
+  }
+  return n;
+}
+
+
+/* Feeds a string to the state, s->live must have room for state_walks(str)
+ * more nodes */
+static void state_feed(struct exclude_state *s, const char *str) {
+  const unsigned char *p = (const unsigned char *)str;
+  uint64_t m, st, carry, any = 1;
+  int i, j, w;
+
+  for(; *p && !s->all; p++) {
+    if(s->prev < 0 || (s->prev == '/' && *p != '/')) {
+      if(ftrie.n > 1)
+        s->live[s->nlive++] = 0;
+      for(w=0; w<nwords; w++)
+        s->d[w] |= nfa_start[w];
+      any = 1;
+    }
+    if(*p >= 128)
+      s->ascii = 0;
+    s->prev = *p;
+
+    for(i=j=0; i<s->nlive; i++)
+      if((s->live[j] = trie_next(&ftrie, s->live[i], *p)) != 0) {
+        if(ftrie.flags[s->live[j]])
+          s->all = 1;
+        j++;
+      }
+    s->nlive = j;
+
+    if(!any)
+      continue;
+    /* Advance the states that match this byte, keep the stars */
+    for(w=0, carry=0, any=0; w<nwords; w++) {
+      m = s->d[w] & nfa_match[*p*nwords + w];
+      s->d[w] = (m << 1) | carry | (s->d[w] & nfa_star[w]);
+      carry = m >> 63;
+      any |= s->d[w];
+    }
+    /* A star may match the empty string */
+    for(w=0, carry=0; w<nwords; w++) {
+      st = s->d[w] & nfa_star[w];
+      s->d[w] |= (st << 1) | carry;
+      carry = st >> 63;
+    }
+  }
+}
+
+
+/* Whether the full path matches, given the state after feeding it */
+static int state_match(struct exclude_state *s, const char *path) {
+  size_t i, len = strlen(path);
+  uint32_t node = 0;
+  int w;
+
+  if(s->all)
+    return 1;
 
-  for(n=excludes; n!=NULL; n=n->next) {
-    if(!fnmatch(n->pattern, path, 0))
+  /* Literals and suffixes, from the end of the path */
+  if(rtrie.flags[0] & TRIE_ANY || (rtrie.flags[0] & TRIE_WORD && COMPONENT(path, len)))
+    return 1;
+  for(i=len; i>0 && (node = trie_next(&rtrie, node, path[i-1])) != 0; i--)
+    if(rtrie.flags[node] & TRIE_ANY || (rtrie.flags[node] & TRIE_WORD && COMPONENT(path, i-1)))
       return 1;
-    for(c = path; *c; c++)
-      if(*c == '/' && c[1] != '/' && !fnmatch(n->pattern, c+1, 0))
+
+  if(nwords) {
+    /* After a trailing slash there is an empty component */
+    if(s->prev < 0 || s->prev == '/')
+      for(w=0; w<nwords; w++)
+        s->d[w] |= nfa_start[w];
+    for(w=0; w<nwords; w++)
+      if(s->d[w] & nfa_end[w] & (s->ascii ? ~(uint64_t)0 : ~nfa_ascii[w]))
         return 1;
   }
+
+  for(i=0; i<(size_t)nfnm_all; i++)
+    if(fnmatch_path(fnm_all[i], path))
+      return 1;
+  for(i=0; !s->ascii && i<(size_t)nfnm_mb; i++)
+    if(fnmatch_path(fnm_mb[i], path))
+      return 1;
   return 0;
 }
 
 
+/* Creates the state after feeding str to a copy of parent, or to the initial
+ * state if parent is NULL, and a slash if that doesn't end with one */
+static struct exclude_state *state_new(const struct exclude_state *parent, const char *str, int slash) {
+  struct exclude_state *s = xcalloc(1, sizeof(struct exclude_state));
+  int size = state_walks(str) + 1 + (parent ? parent->nlive : 0);
+
+  s->live = xmalloc(size*sizeof(uint32_t));
+  s->d = xcalloc(nwords ? nwords : 1, sizeof(uint64_t));
+  if(parent) {
+    s->prev = parent->prev;
+    s->ascii = parent->ascii;
+    s->all = parent->all;
+    s->nlive = parent->nlive;
+    memcpy(s->live, parent->live, parent->nlive*sizeof(uint32_t));
+    memcpy(s->d, parent->d, nwords*sizeof(uint64_t));
+  } else {
+    s->prev = -1;
+    s->ascii = 1;
+  }
+  state_feed(s, str);
+  if(slash && s->prev != '/')
+    state_feed(s, "/");
+  return s;
+}
+
+
+static void state_free(struct exclude_state *s) {
+  free(s->live);
+  free(s->d);
+  free(s);
+}
+
+
+struct exclude_state *exclude_dir(const struct exclude_state *parent, const char *name) {
+  if(!parent)
+    matcher_update();
+  return excludes ? state_new(parent, name, 1) : NULL;
+}
+
+
+void exclude_dir_free(struct exclude_state *s) {
+  if(s)
+    state_free(s);
+}
+
+
+int exclude_dir_match(const struct exclude_state *dir, const char *path, const char *name) {
+  struct exclude_state s;
+  uint32_t live[16];
+  uint64_t d[16];
+  int r, size;
+
+  if(!dir)
+    return 0;
+  if(dir->all)
+    return 1;
+
+  s = *dir;
+  size = dir->nlive + state_walks(name);
+  s.live = size <= 16 ? live : xmalloc(size*sizeof(uint32_t));
+  s.d = nwords <= 16 ? d : xmalloc(nwords*sizeof(uint64_t));
+  memcpy(s.live, dir->live, dir->nlive*sizeof(uint32_t));
+  memcpy(s.d, dir->d, nwords*sizeof(uint64_t));
+
+  state_feed(&s, name);
+  r = state_match(&s, path);
+
+  if(s.live != live)
+    free(s.live);
+  if(s.d != d)
+    free(s.d);
+  return r;
+}
+
+
+int exclude_match(char *path) {
+  struct exclude_state *s;
+  int r;
+
+  if(!excludes)
+    return 0;
+  matcher_update();
+  s = state_new(NULL, path, 0);
+  r = state_match(s, path);
+  state_free(s);
+  return r;
+}
+
+
+/*
+ * Exclusion of directories that contain a marker file, such as CACHEDIR.TAG
+ * (see http://www.brynosaurus.com/cachedir/). The names are looked up in the
+ * listing of the directory, so the file is only opened if it's there.
+ */
+static struct marker {
+  char *name;
+  char *sig; /* the file has to start with this, or NULL */
+} *markers = NULL;
+static int nmarkers = 0;
+static unsigned char marker_first[32]; /* set of first bytes of the names */
+
+
+void exclude_marker_add(const char *name, const char *sig) {
+  int i;
+
+  for(i=0; i<nmarkers; i++)
+    if(strcmp(markers[i].name, name) == 0)
+      return;
+  markers = xrealloc(markers, (nmarkers+1)*sizeof(struct marker));
+  markers[nmarkers].name = xmalloc(strlen(name)+1);
+  strcpy(markers[nmarkers].name, name);
+  markers[nmarkers].sig = NULL;
+  if(sig) {
+    markers[nmarkers].sig = xmalloc(strlen(sig)+1);
+    strcpy(markers[nmarkers].sig, sig);
+  }
+  marker_first[(unsigned char)*name/8] |= 1 << ((unsigned char)*name%8);
+  nmarkers++;
+}
+
+
+int exclude_markers() {
+  return nmarkers;
+}
+
+
+int exclude_marker(int dirfd, const char *name) {
+  char buf[256];
+  size_t len;
+  int i, fd, match;
+
+  if(!(marker_first[(unsigned char)*name/8] & (1 << ((unsigned char)*name%8))))
+    return 0;
+  for(i=0; i<nmarkers; i++)
+    if(strcmp(markers[i].name, name) == 0)
+      break;
+  if(i == nmarkers)
+    return 0;
+  if(!markers[i].sig)
+    return 1;
+
+  len = strlen(markers[i].sig);
+  if(len > sizeof(buf) || (fd = openat(dirfd, name, O_RDONLY)) < 0)
+    return 0;
+  match = read(fd, buf, len) == (ssize_t)len && !memcmp(buf, markers[i].sig, len);
+  close(fd);
+  return match;
+}
+
+
 void exclude_clear() {
   struct exclude *n, *l;
+  int i;
 
   for(n=excludes; n!=NULL; n=l) {
     l = n->next;
@@ -97,42 +721,16 @@ void exclude_clear() {
     free(n);
   }
   excludes = NULL;
-}
-
-
-/*
- * Exclusion of directories that contain only cached information.
- * See http://www.brynosaurus.com/cachedir/
- */
-#define CACHEDIR_TAG_FILENAME "CACHEDIR.TAG"
-#define CACHEDIR_TAG_SIGNATURE "Signature: 8a477f597d28d172789f06886806bc55"
-
-int has_cachedir_tag(const char *name) {
-  static int path_l = 1024;
-  static char *path = NULL;
-  int l;
-  char buf[sizeof CACHEDIR_TAG_SIGNATURE - 1];
-  FILE *f;
-  int match = 0;
-
-  /* Compute the required length for `path`. */
-  l = strlen(name) + sizeof CACHEDIR_TAG_FILENAME + 2;
-  if(l > path_l || path == NULL) {
-    path_l = path_l * 2;
-    if(path_l < l)
-      path_l = l;
-    /* We don't need to copy the content of `path`, so it's more efficient to
-     * use `free` + `malloc`. */
-    free(path);
-    path = xmalloc(path_l);
-  }
-  snprintf(path, path_l, "%s/%s", name, CACHEDIR_TAG_FILENAME);
-  f = fopen(path, "rb");
+  excludes_end = &excludes;
+  matcher_free();
+  matcher_built = 0;
 
-  if(f != NULL) {
-    match = ((fread(buf, 1, sizeof buf, f) == sizeof buf) &&
-                !memcmp(buf, CACHEDIR_TAG_SIGNATURE, sizeof buf));
-    fclose(f);
+  for(i=0; i<nmarkers; i++) {
+    free(markers[i].name);
+    free(markers[i].sig);
   }
-  return match;
+  free(markers);
+  markers = NULL;
+  nmarkers = 0;
+  memset(marker_first, 0, sizeof(marker_first));
 }
@@ -30,6 +30,22 @@ void exclude_add(char *);
 int  exclude_addfile(char *);
 int  exclude_match(char *);
 void exclude_clear(void);
-int  has_cachedir_tag(const char *name);
+
+/* Marker files: exclude_marker() is given a name from the listing of dirfd
+ * and returns whether the directory should be excluded */
+#define CACHEDIR_TAG_FILENAME "CACHEDIR.TAG"
+#define CACHEDIR_TAG_SIGNATURE "Signature: 8a477f597d28d172789f06886806bc55"
+void exclude_marker_add(const char *, const char *);
+int  exclude_markers(void);
+int  exclude_marker(int, const char *);
+
+/* Per-directory match state: exclude_dir(NULL, path) for the directory at
+ * path, exclude_dir(parent, name) for a subdirectory. exclude_dir_match()
+ * takes the full path of an item in the directory and its name. The state is
+ * NULL if there are no patterns. */
+struct exclude_state;
+struct exclude_state *exclude_dir(const struct exclude_state *, const char *);
+void exclude_dir_free(struct exclude_state *);
+int  exclude_dir_match(const struct exclude_state *, const char *, const char *);
 
 #endif
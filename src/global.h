@@ -53,6 +53,11 @@
 #define FF_EXT    0x100 /* extended struct available */
 #define FF_KERNFS 0x200 /* excluded because it was a Linux pseudo filesystem */
 #define FF_FRMLNK 0x400 /* excluded because it was a firmlink */
+#define FF_VROOT  0x800 /* virtual directory that holds multiple roots */
+#define FF_BNDMNT 0x1000 /* excluded because it was a bind mount of a directory already counted */
+#define FF_EST    0x2000 /* size is estimated (--estimate), for directories: includes estimates */
+#define FF_AGGR   0x4000 /* directory below --max-depth, its contents are counted but not kept */
+#define FF_SHR    0x8000 /* shared struct available (directories in the tree) */
 
 /* Program states */
 #define ST_CALC   0
@@ -92,6 +97,14 @@ struct dir_ext {
   unsigned short mode;
 };
 
+/* Sizes of the hard links below a directory of which not every link is below
+ * it, i.e. the part of size and asize that deleting the directory wouldn't
+ * free. Only links within the scanned tree are known. Stored after the name
+ * and dir_ext fields of directories with FF_SHR, see dir_shr_ptr(). */
+struct dir_shr {
+  int64_t size, asize;
+};
+
 
 /* program state */
 extern int pstate;
@@ -99,8 +112,6 @@ extern int pstate;
 extern int read_only;
 /* minimum screen update interval when calculating, in ms */
 extern long update_delay;
-/* filter directories with CACHEDIR.TAG */
-extern int cachedir_tags;
 /* flag if we should ask for confirmation when quitting */
 extern int confirm_quit;
 /* flag whether we want to enable use of struct dir_ext */
@@ -123,10 +134,13 @@ void close_nc(void);
 #include "dir.h"
 #include "dirlist.h"
 #include "exclude.h"
+#include "mount.h"
 #include "help.h"
 #include "path.h"
+#include "uring.h"
 #include "util.h"
 #include "shell.h"
 #include "quit.h"
+#include "watch.h"
 
 #endif
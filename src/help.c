@@ -32,7 +32,7 @@
 static int page, start;
 
 
-#define KEYS 19
+#define KEYS 22
 static const char *keys[KEYS*2] = {
 /*|----key----|  |----------------description----------------|*/
         "up, k", "Move cursor up",
@@ -43,21 +43,24 @@ static const char *keys[KEYS*2] = {
             "s", "Sort by size (ascending/descending)",
             "C", "Sort by items (ascending/descending)",
             "M", "Sort by mtime (-e flag)",
+            "U", "Sort by exclusive or shared size",
             "d", "Delete selected file or directory",
             "t", "Toggle dirs before files when sorting",
             "g", "Show percentage and/or graph",
             "a", "Toggle between apparent size and disk usage",
             "c", "Toggle display of child item counts",
             "m", "Toggle display of latest mtime (-e flag)",
+            "u", "Show exclusive or shared size of hard links",
             "e", "Show/hide hidden or excluded files",
             "i", "Show information about selected item",
+            "S", "Show slowest and largest scanned directories",
             "r", "Recalculate the current directory",
             "b", "Spawn shell in current directory",
             "q", "Quit ncdu"
 };
 
 
-#define FLAGS 9
+#define FLAGS 13
 static const char *flags[FLAGS*2] = {
     "!", "An error occurred while reading this directory",
     ".", "An error occurred while reading a subdirectory",
@@ -68,6 +71,10 @@ static const char *flags[FLAGS*2] = {
     "^", "Excluded Linux pseudo-filesystem",
     "H", "Same file was already counted (hard link)",
     "F", "Excluded firmlink",
+    "B", "Excluded bind mount of a directory already counted",
+    "~", "Size is estimated from a sample (--estimate)",
+    "+", "Contents not loaded (--max-depth), scanned when entered",
+    "*", "Size is still being counted (browsing during a scan)",
 };
 
 void help_draw() {
@@ -39,7 +39,6 @@
 int pstate;
 int read_only = 0;
 long update_delay = 100;
-int cachedir_tags = 0;
 int extended_info = 0;
 int follow_symlinks = 0;
 int follow_firmlinks = 1;
@@ -68,6 +67,18 @@ static void screen_draw(void) {
  *   0: blocking wait for input and always draw screen
  *   1: non-blocking, draw screen only if a configured delay has passed or after keypress
  */
+static void input_delay(int wait) {
+#if USE_WATCH
+  /* Wake up regularly to apply file system changes */
+  if(!wait && watch_active) {
+    timeout(update_delay);
+    return;
+  }
+#endif
+  nodelay(stdscr, wait?1:0);
+}
+
+
 int input_handle(int wait) {
   int ch;
   struct timeval tv;
@@ -87,14 +98,14 @@ int input_handle(int wait) {
   if(!ncurses_init)
     return wait == 0 ? 1 : 0;
 
-  nodelay(stdscr, wait?1:0);
+  input_delay(wait);
   errno = 0;
   while((ch = getch()) != ERR) {
     if(ch == KEY_RESIZE) {
       if(ncresize(min_rows, min_cols))
         min_rows = min_cols = 0;
       /* ncresize() may change nodelay state, make sure to revert it. */
-      nodelay(stdscr, wait?1:0);
+      input_delay(wait);
       screen_draw();
       continue;
     }
@@ -120,13 +131,16 @@ static void argv_parse(int argc, char **argv) {
   char *val;
   char *export = NULL;
   char *import = NULL;
-  char *dir = NULL;
+  char *checkpoint = NULL;
+  char **dirs = NULL;
+  int ndirs = 0;
 
   static yopt_opt_t opts[] = {
     { 'h', 0, "-h,-?,--help" },
     { 'q', 0, "-q" },
     { 'v', 0, "-v,-V,--version" },
     { 'x', 0, "-x" },
+    { 't', 1, "-t,--threads" },
     { 'e', 0, "-e" },
     { 'r', 0, "-r" },
     { 'o', 1, "-o" },
@@ -138,9 +152,27 @@ static void argv_parse(int argc, char **argv) {
     { 'X', 1, "-X,--exclude-from" },
     { 'L', 0, "-L,--follow-symlinks" },
     { 'C', 0, "--exclude-caches" },
+    { 15,  1, "--exclude-if-present" },
     {  2,  0, "--exclude-kernfs" },
+    { 14,  1, "--exclude-fstype" },
+    { 16,  0, "--exclude-bind-mounts" },
     {  3,  0, "--follow-firmlinks" }, /* undocumented, this behavior is the current default */
     {  4,  0, "--exclude-firmlinks" },
+    {  5,  0, "--fast-stat" },
+    {  6,  0, "--io-uring" },
+    {  7,  0, "--inode-order" },
+    {  8,  0, "--no-inode-order" },
+    {  9,  1, "--incremental" },
+    { 20,  1, "--checkpoint" },
+    { 21,  1, "--resume" },
+    { 10,  0, "--watch" },
+    { 11,  1, "--watch-limit" },
+    { 12,  1, "--max-iops" },
+    { 12,  1, "--max-ops-per-sec" },
+    { 13,  0, "--idle" },
+    { 17,  1, "--estimate" },
+    { 18,  1, "--max-depth" },
+    { 19,  0, "--breadth-first" },
     { 's', 0, "--si" },
     { 'Q', 0, "--confirm-quit" },
     { 'c', 1, "--color" },
@@ -153,28 +185,57 @@ static void argv_parse(int argc, char **argv) {
   yopt_init(&yopt, argc, argv, opts);
   while((v = yopt_next(&yopt, &val)) != -1) {
     switch(v) {
-    case  0 : dir = val; break;
+    case  0 :
+      dirs = xrealloc(dirs, (ndirs+1)*sizeof(char *));
+      dirs[ndirs++] = val;
+      break;
     case 'h':
-      printf("ncdu <options> <directory>\n\n");
+      printf("ncdu <options> <directory>...\n\n");
       printf("  -h,--help                  This help message\n");
       printf("  -q                         Quiet mode, refresh interval 2 seconds\n");
       printf("  -v,-V,--version            Print version\n");
       printf("  -x                         Same filesystem\n");
+      printf("  -t,--threads NUM           Number of threads to scan with\n");
       printf("  -e                         Enable extended information\n");
       printf("  -r                         Read only\n");
       printf("  -o FILE                    Export scanned directory to FILE\n");
       printf("  -f FILE                    Import scanned directory from FILE\n");
+      printf("  --incremental FILE         Reuse unchanged directories from export FILE\n");
+      printf("  --checkpoint FILE          Keep writing the scanned part to FILE while scanning\n");
+      printf("  --resume FILE              Continue the interrupted scan in checkpoint FILE\n");
       printf("  -0,-1,-2                   UI to use when scanning (0=none,2=full ncurses)\n");
       printf("  --si                       Use base 10 (SI) prefixes instead of base 2\n");
+      printf("  --inode-order              Read file information in inode order\n");
+      printf("  --no-inode-order           Read file information in directory order\n");
+      printf("  --max-iops NUM             Limit file system operations per second\n");
+#if HAVE_SYS_SYSCALL_H && HAVE_DECL_SYS_IOPRIO_SET
+      printf("  --idle                     Scan with idle CPU and I/O priority\n");
+#endif
+      printf("  --estimate NUM             Stat NUM files per directory and estimate the rest\n");
+      printf("  --max-depth NUM            Keep NUM levels in memory, scan deeper ones when entered\n");
+      printf("  --breadth-first            Scan level by level and show the largest entries so far\n");
       printf("  --exclude PATTERN          Exclude files that match PATTERN\n");
       printf("  -X, --exclude-from FILE    Exclude files that match any pattern in FILE\n");
       printf("  -L, --follow-symlinks      Follow symbolic links (excluding directories)\n");
       printf("  --exclude-caches           Exclude directories containing CACHEDIR.TAG\n");
-#if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
+      printf("  --exclude-if-present FILE  Exclude directories containing FILE\n");
+#if USE_MOUNT
       printf("  --exclude-kernfs           Exclude Linux pseudo filesystems (procfs,sysfs,cgroup,...)\n");
+      printf("  --exclude-fstype TYPES     Exclude filesystems of the given comma-separated types\n");
+      printf("  --exclude-bind-mounts      Exclude bind mounts of directories already counted\n");
 #endif
 #if HAVE_SYS_ATTR_H && HAVE_GETATTRLIST && HAVE_DECL_ATTR_CMNEXT_NOFIRMLINKPATH
       printf("  --exclude-firmlinks        Exclude firmlinks on macOS\n");
+#endif
+#if HAVE_STATX && HAVE_SYS_SYSMACROS_H
+      printf("  --fast-stat                Allow cached file attributes on network filesystems\n");
+#endif
+#if USE_URING
+      printf("  --io-uring                 Use io_uring to batch file system calls\n");
+#endif
+#if USE_WATCH
+      printf("  --watch                    Keep the tree up to date after scanning\n");
+      printf("  --watch-limit NUM          Maximum number of directories to watch with inotify\n");
 #endif
       printf("  --confirm-quit             Confirm quitting ncdu\n");
       printf("  --color SCHEME             Set color scheme (off/dark)\n");
@@ -184,6 +245,13 @@ static void argv_parse(int argc, char **argv) {
       printf("ncdu %s\n", PACKAGE_VERSION);
       exit(0);
     case 'x': dir_scan_smfs = 1; break;
+    case 't':
+      dir_scan_threads = atoi(val);
+      if(dir_scan_threads < 1) {
+        fprintf(stderr, "Invalid number of threads: %s\n", val);
+        exit(1);
+      }
+      break;
     case 'e': extended_info = 1; break;
     case 'r': read_only++; break;
     case 's': si = 1; break;
@@ -202,11 +270,18 @@ static void argv_parse(int argc, char **argv) {
       break;
     case 'L': follow_symlinks = 1; break;
     case 'C':
-      cachedir_tags = 1;
+      exclude_marker_add(CACHEDIR_TAG_FILENAME, CACHEDIR_TAG_SIGNATURE);
+      break;
+    case 15: /* --exclude-if-present */
+      if(!*val || strchr(val, '/')) {
+        fprintf(stderr, "Invalid file name for --exclude-if-present: %s\n", val);
+        exit(1);
+      }
+      exclude_marker_add(val, NULL);
       break;
 
     case  2 : /* --exclude-kernfs */
-#if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
+#if USE_MOUNT
       exclude_kernfs = 1; break;
 #else
       fprintf(stderr, "This feature is not supported on your platform\n");
@@ -225,6 +300,89 @@ static void argv_parse(int argc, char **argv) {
 #else
       fprintf(stderr, "This feature is not supported on your platform\n");
       exit(1);
+#endif
+    case  5 : /* --fast-stat */
+#if HAVE_STATX && HAVE_SYS_SYSMACROS_H
+      fast_stat = 1; break;
+#else
+      fprintf(stderr, "This feature is not supported on your platform\n");
+      exit(1);
+#endif
+    case  6 : /* --io-uring */
+#if USE_URING
+      dir_scan_uring = 1; break;
+#else
+      fprintf(stderr, "This feature is not supported on your platform\n");
+      exit(1);
+#endif
+    case  7 : dir_scan_inode_order = 1; break;
+    case  8 : dir_scan_inode_order = 0; break;
+    case  9 : dir_scan_incremental = val; break;
+    case 20 : checkpoint = val; break;
+    case 21 : dir_scan_resume = val; break;
+    case 10 : /* --watch */
+#if USE_WATCH
+      watch_enabled = 1; break;
+#else
+      fprintf(stderr, "This feature is not supported on your platform\n");
+      exit(1);
+#endif
+    case 11 : /* --watch-limit */
+#if USE_WATCH
+      watch_limit = atoi(val);
+      if(watch_limit < 0) {
+        fprintf(stderr, "Invalid watch limit: %s\n", val);
+        exit(1);
+      }
+      break;
+#else
+      fprintf(stderr, "This feature is not supported on your platform\n");
+      exit(1);
+#endif
+    case 12 : /* --max-iops */
+      dir_scan_max_iops = atoi(val);
+      if(dir_scan_max_iops < 1) {
+        fprintf(stderr, "Invalid number of operations per second: %s\n", val);
+        exit(1);
+      }
+      break;
+    case 17 : /* --estimate */
+      dir_scan_estimate = atoi(val);
+      if(dir_scan_estimate < 2) {
+        fprintf(stderr, "Invalid number of files to sample: %s\n", val);
+        exit(1);
+      }
+      break;
+    case 19 : /* --breadth-first */
+      dir_scan_breadth_first = 1;
+      break;
+    case 18 : /* --max-depth */
+      dir_mem_max_depth = atoi(val);
+      if(dir_mem_max_depth < 1) {
+        fprintf(stderr, "Invalid depth: %s\n", val);
+        exit(1);
+      }
+      break;
+    case 13 : /* --idle */
+#if HAVE_SYS_SYSCALL_H && HAVE_DECL_SYS_IOPRIO_SET
+      dir_scan_idle = 1; break;
+#else
+      fprintf(stderr, "This feature is not supported on your platform\n");
+      exit(1);
+#endif
+    case 14 : /* --exclude-fstype */
+#if USE_MOUNT
+      mount_exclude_add(val); break;
+#else
+      fprintf(stderr, "This feature is not supported on your platform\n");
+      exit(1);
+#endif
+    case 16 : /* --exclude-bind-mounts */
+#if USE_MOUNT
+      exclude_bindmounts = 1; break;
+#else
+      fprintf(stderr, "This feature is not supported on your platform\n");
+      exit(1);
 #endif
     case 'c':
       if(strcmp(val, "off") == 0)  { uic_theme = 0; }
@@ -240,6 +398,35 @@ static void argv_parse(int argc, char **argv) {
     }
   }
 
+  /* The directory mtimes are needed to detect changes */
+  if(dir_scan_incremental) {
+    extended_info = 1;
+    if(export && strcmp(export, dir_scan_incremental) == 0) {
+      fprintf(stderr, "Can't export to the file given to --incremental.\n");
+      exit(1);
+    }
+  }
+
+  if(checkpoint && (export || import)) {
+    fprintf(stderr, "--checkpoint can't be combined with -o or -f.\n");
+    exit(1);
+  }
+  if(dir_scan_resume && (dir_scan_incremental || import)) {
+    fprintf(stderr, "--resume can't be combined with --incremental or -f.\n");
+    exit(1);
+  }
+  if(dir_scan_resume && ((checkpoint && strcmp(checkpoint, dir_scan_resume) == 0) || (export && strcmp(export, dir_scan_resume) == 0))) {
+    fprintf(stderr, "Can't write to the file given to --resume.\n");
+    exit(1);
+  }
+
+#if USE_WATCH
+  if(watch_enabled && (export || import)) {
+    fprintf(stderr, "--watch can't be combined with -o or -f.\n");
+    exit(1);
+  }
+#endif
+
   if(export) {
     if(dir_export_init(export)) {
       fprintf(stderr, "Can't open %s: %s\n", export, strerror(errno));
@@ -250,6 +437,11 @@ static void argv_parse(int argc, char **argv) {
   } else
     dir_mem_init(NULL);
 
+  if(checkpoint && dir_checkpoint_init(checkpoint)) {
+    fprintf(stderr, "Can't open %s: %s\n", checkpoint, strerror(errno));
+    exit(1);
+  }
+
   if(import) {
     if(dir_import_init(import)) {
       fprintf(stderr, "Can't open %s: %s\n", import, strerror(errno));
@@ -257,8 +449,11 @@ static void argv_parse(int argc, char **argv) {
     }
     if(strcmp(import, "-") == 0)
       ncurses_tty = 1;
-  } else
-    dir_scan_init(dir ? dir : ".");
+  } else if(ndirs)
+    dir_scan_init_roots(dirs, ndirs);
+  else
+    dir_scan_init(".");
+  free(dirs);
 
   /* Use the single-line scan feedback by default when exporting to file, no
    * feedback when exporting to stdout. */
@@ -347,8 +542,14 @@ int main(int argc, char **argv) {
       }
     } else if(pstate == ST_DEL)
       delete_process();
-    else if(input_handle(0))
-      break;
+    else {
+#if USE_WATCH
+      if(pstate == ST_BROWSE)
+        watch_poll();
+#endif
+      if(input_handle(0))
+        break;
+    }
   }
 
   close_nc();
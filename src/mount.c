@@ -0,0 +1,412 @@
+/* ncdu - NCurses Disk Usage
+
+  Copyright (c) 2007-2020 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+
+#if USE_MOUNT
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/statfs.h>
+#include <linux/magic.h>
+#if HAVE_SYS_SYSMACROS_H
+#include <sys/sysmacros.h>
+#endif
+
+#include <khashl.h>
+
+
+int exclude_kernfs;
+int exclude_bindmounts;
+
+static char **fstypes; /* --exclude-fstype types */
+static int nfstypes;
+
+/* device -> FF_KERNFS, FF_OTHFS or 0 */
+KHASHL_MAP_INIT(KH_LOCAL, mt_t, mt, uint64_t, int, kh_hash_uint64, kh_eq_generic)
+static mt_t *table;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* For --exclude-bind-mounts, all mounts from the mount table and the scanned
+ * roots. Read-only while scanning. */
+static struct mnt {
+  uint64_t dev;
+  char *root;  /* directory of the filesystem that is mounted */
+  char *point; /* mount point */
+  int flag;    /* FF_BNDMNT if the directory is also reached another way */
+} *mnts, *roots;
+static int nmnts, nroots, nbinds;
+
+/* mount point -> index in mnts, of the last mount on it */
+KHASHL_MAP_INIT(KH_LOCAL, mp_t, mp, const char *, int, kh_hash_str, kh_eq_str)
+static mp_t *points;
+
+
+static const char *kernfs_types[] = {
+  "binfmt_misc", "bpf", "cgroup", "cgroup2", "debugfs", "devpts", "proc",
+  "pstore", "securityfs", "selinuxfs", "sysfs", "tracefs", NULL
+};
+
+
+static int is_kernfs(unsigned long type) {
+  if(
+#ifdef BINFMTFS_MAGIC
+     type == BINFMTFS_MAGIC ||
+#endif
+#ifdef BPF_FS_MAGIC
+     type == BPF_FS_MAGIC ||
+#endif
+#ifdef CGROUP_SUPER_MAGIC
+     type == CGROUP_SUPER_MAGIC ||
+#endif
+#ifdef CGROUP2_SUPER_MAGIC
+     type == CGROUP2_SUPER_MAGIC||
+#endif
+#ifdef DEBUGFS_MAGIC
+     type == DEBUGFS_MAGIC ||
+#endif
+#ifdef DEVPTS_SUPER_MAGIC
+     type == DEVPTS_SUPER_MAGIC ||
+#endif
+#ifdef PROC_SUPER_MAGIC
+     type == PROC_SUPER_MAGIC ||
+#endif
+#ifdef PSTOREFS_MAGIC
+     type == PSTOREFS_MAGIC ||
+#endif
+#ifdef SECURITYFS_MAGIC
+     type == SECURITYFS_MAGIC ||
+#endif
+#ifdef SELINUX_MAGIC
+     type == SELINUX_MAGIC ||
+#endif
+#ifdef SYSFS_MAGIC
+     type == SYSFS_MAGIC ||
+#endif
+#ifdef TRACEFS_MAGIC
+     type == TRACEFS_MAGIC ||
+#endif
+     0
+    )
+    return 1;
+  return 0;
+}
+
+
+void mount_exclude_add(const char *list) {
+  const char *end;
+  size_t len;
+
+  for(; *list; list = *end ? end+1 : end) {
+    end = strchr(list, ',');
+    if(!end)
+      end = list+strlen(list);
+    if((len = end-list) == 0)
+      continue;
+    fstypes = xrealloc(fstypes, (nfstypes+1)*sizeof(char *));
+    fstypes[nfstypes] = xmalloc(len+1);
+    memcpy(fstypes[nfstypes], list, len);
+    fstypes[nfstypes++][len] = 0;
+  }
+}
+
+
+int mount_active(void) {
+  return exclude_kernfs || nfstypes;
+}
+
+
+static int type_exclude(const char *type) {
+  int i;
+  if(exclude_kernfs)
+    for(i=0; kernfs_types[i]; i++)
+      if(strcmp(type, kernfs_types[i]) == 0)
+        return FF_KERNFS;
+  for(i=0; i<nfstypes; i++)
+    if(strcmp(type, fstypes[i]) == 0)
+      return FF_OTHFS;
+  return 0;
+}
+
+
+static void mnts_free(void) {
+  int i;
+  for(i=0; i<nmnts; i++) {
+    free(mnts[i].root);
+    free(mnts[i].point);
+  }
+  for(i=0; i<nroots; i++) {
+    free(roots[i].root);
+    free(roots[i].point);
+  }
+  free(mnts);
+  free(roots);
+  mnts = roots = NULL;
+  nmnts = nroots = nbinds = 0;
+  if(points)
+    mp_destroy(points);
+  points = NULL;
+}
+
+
+#if HAVE_SYS_SYSMACROS_H
+
+/* Copies a path field of mountinfo, in which spaces and such are escaped as
+ * \ooo. Returns the position after the field. */
+static char *field_path(char *s, char **dest) {
+  char *d;
+
+  while(*s == ' ')
+    s++;
+  d = *dest = xmalloc(strcspn(s, " \n")+1);
+  while(*s && *s != ' ' && *s != '\n') {
+    if(s[0] == '\\' && s[1] >= '0' && s[1] <= '3' && s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+      *d++ = (s[1]-'0')*64 + (s[2]-'0')*8 + (s[3]-'0');
+      s += 4;
+    } else
+      *d++ = *s++;
+  }
+  *d = 0;
+  return s;
+}
+
+
+static void points_init(void) {
+  khint_t k;
+  int i, absent;
+
+  points = mp_init();
+  for(i=0; i<nmnts; i++) {
+    k = mp_put(points, mnts[i].point, &absent);
+    kh_val(points, k) = i;
+  }
+}
+
+#endif
+
+
+void mount_init(void) {
+#if HAVE_SYS_SYSMACROS_H
+  FILE *f;
+  char *line = NULL, *sep, *s, type[64];
+  size_t len = 0;
+  unsigned int maj, min;
+  khint_t k;
+  int absent, n;
+  struct mnt *m;
+#endif
+
+  if(!mount_active() && !exclude_bindmounts)
+    return;
+  pthread_mutex_lock(&lock);
+  if(table)
+    mt_destroy(table);
+  table = mt_init();
+  mnts_free();
+
+#if HAVE_SYS_SYSMACROS_H
+  /* Lines look like: 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+   * The device, root, mount point and the filesystem type after the
+   * separator are used. */
+  if((f = fopen("/proc/self/mountinfo", "r")) != NULL) {
+    while(getline(&line, &len, f) > 0) {
+      if(sscanf(line, "%*d %*d %u:%u%n", &maj, &min, &n) != 2)
+        continue;
+      if((sep = strstr(line, " - ")) == NULL || sscanf(sep+3, "%63s", type) != 1)
+        continue;
+      k = mt_put(table, (uint64_t)makedev(maj, min), &absent);
+      kh_val(table, k) = type_exclude(type);
+
+      if(exclude_bindmounts) {
+        mnts = xrealloc(mnts, (nmnts+1)*sizeof(struct mnt));
+        m = mnts + nmnts++;
+        m->dev = (uint64_t)makedev(maj, min);
+        m->flag = 0;
+        s = field_path(line+n, &m->root);
+        field_path(s, &m->point);
+      }
+    }
+    free(line);
+    fclose(f);
+  }
+  if(exclude_bindmounts)
+    points_init();
+#endif
+  pthread_mutex_unlock(&lock);
+}
+
+
+/* Whether directory b of a filesystem is a (sub)directory of a */
+static int covers(const char *a, const char *b) {
+  size_t l = strlen(a);
+  return (l == 1 && *a == '/') || (strncmp(a, b, l) == 0 && (b[l] == 0 || b[l] == '/'));
+}
+
+
+/* Whether m is the mount that is visible at its mount point */
+static int visible(const struct mnt *m) {
+  return mnts + kh_val(points, mp_get(points, m->point)) == m;
+}
+
+
+static int point_cmp(const void *va, const void *vb) {
+  const struct mnt *a = *(struct mnt **)va, *b = *(struct mnt **)vb;
+  size_t la = strlen(a->point), lb = strlen(b->point);
+  return la < lb ? -1 : la > lb ? 1 : a < b ? -1 : a > b ? 1 : 0;
+}
+
+
+/* Decides which mounts in the scanned roots are duplicates, going from the
+ * shortest mount point to the longest. A mount is a duplicate if it shows a
+ * directory of a filesystem that is (under) the directory shown by a scanned
+ * root or by a mount that is kept. Mounts under a duplicate are not reached. */
+static void binds_resolve(void) {
+  struct mnt **order, *a, *b;
+  int i, j, k, in;
+
+  if(!nmnts)
+    return;
+  order = xmalloc(nmnts*sizeof(struct mnt *));
+  for(i=0; i<nmnts; i++)
+    order[i] = mnts+i;
+  qsort(order, nmnts, sizeof(struct mnt *), point_cmp);
+
+  for(i=nbinds=0; i<nmnts; i++) {
+    a = order[i];
+    a->flag = -1;
+    if(!visible(a))
+      continue;
+    for(j=0, in=0; j<nroots && !in; j++)
+      in = strcmp(roots[j].point, a->point) != 0 && covers(roots[j].point, a->point);
+    for(k=0; k<i && in; k++)
+      in = !(order[k]->flag > 0 && covers(order[k]->point, a->point));
+    if(!in)
+      continue;
+
+    for(j=0, in=0; j<nroots && !in; j++)
+      in = roots[j].dev == a->dev && covers(roots[j].root, a->root);
+    for(k=0; k<i && !in; k++) {
+      b = order[k];
+      in = b->flag == 0 && b->dev == a->dev && covers(b->root, a->root);
+    }
+    a->flag = in ? FF_BNDMNT : 0;
+    nbinds += in;
+  }
+  free(order);
+}
+
+
+void mount_root(const char *path) {
+  struct mnt *m = NULL, *r;
+  size_t l, best = 0;
+  int i;
+
+  if(!exclude_bindmounts)
+    return;
+  pthread_mutex_lock(&lock);
+
+  /* The mount with the longest mount point that contains path */
+  for(i=0; i<nmnts; i++)
+    if(visible(mnts+i) && covers(mnts[i].point, path) && (l = strlen(mnts[i].point)) >= best) {
+      m = mnts+i;
+      best = l;
+    }
+
+  roots = xrealloc(roots, (nroots+1)*sizeof(struct mnt));
+  r = roots + nroots++;
+  r->dev = m ? m->dev : 0;
+  r->flag = 0;
+  r->point = xmalloc(strlen(path)+1);
+  strcpy(r->point, path);
+  /* The directory within the filesystem: the root of the mount followed by
+   * the rest of the path */
+  path += best == 1 ? 0 : best;
+  r->root = xmalloc((m ? strlen(m->root) : 0)+strlen(path)+2);
+  strcpy(r->root, m && strcmp(m->root, "/") != 0 ? m->root : "");
+  strcat(r->root, path);
+  if(!*r->root)
+    strcpy(r->root, "/");
+
+  binds_resolve();
+  pthread_mutex_unlock(&lock);
+}
+
+
+int mount_binds(void) {
+  return nbinds;
+}
+
+
+int mount_bind(const char *path) {
+  khint_t k = mp_get(points, path);
+  return k == kh_end(points) ? 0 : mnts[kh_val(points, k)].flag > 0 ? FF_BNDMNT : 0;
+}
+
+
+int mount_exclude(uint64_t dev, int fd, const char *name) {
+  struct statfs fst;
+  khint_t k;
+  int r = 0, found, absent, dfd;
+
+  pthread_mutex_lock(&lock);
+  k = mt_get(table, dev);
+  if((found = k != kh_end(table)))
+    r = kh_val(table, k);
+  pthread_mutex_unlock(&lock);
+  if(found)
+    return r;
+
+  /* Not in the mount table, e.g. a btrfs subvolume or a filesystem that has
+   * been mounted during the scan. The type name isn't known here, so only
+   * pseudo filesystems can be recognized. O_PATH also works for directories
+   * that can be traversed but not read. A failure can be temporary (the
+   * directory may have been removed, or we're out of file descriptors), so
+   * it isn't remembered, and the directory isn't excluded. */
+#ifdef O_PATH
+  dfd = openat(fd, name, O_PATH|O_DIRECTORY);
+#else
+  dfd = openat(fd, name, O_RDONLY|O_DIRECTORY);
+#endif
+  if(dfd < 0)
+    return 0;
+  if(fstatfs(dfd, &fst)) {
+    close(dfd);
+    return 0;
+  }
+  close(dfd);
+  r = exclude_kernfs && is_kernfs(fst.f_type) ? FF_KERNFS : 0;
+  pthread_mutex_lock(&lock);
+  k = mt_put(table, dev, &absent);
+  kh_val(table, k) = r;
+  pthread_mutex_unlock(&lock);
+  return r;
+}
+
+#endif
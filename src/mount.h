@@ -0,0 +1,72 @@
+/* ncdu - NCurses Disk Usage
+
+  Copyright (c) 2007-2020 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+/*
+ mount.c keeps a table of the filesystem type of each device, read from
+ /proc/self/mountinfo before scanning, for --exclude-kernfs and
+ --exclude-fstype. Devices that are not in the table are looked up with
+ statfs() once. The mount points from the same table are used to find bind
+ mounts for --exclude-bind-mounts.
+*/
+
+#ifndef _mount_h
+#define _mount_h
+
+#if HAVE_LINUX_MAGIC_H && HAVE_SYS_STATFS_H && HAVE_STATFS
+
+#define USE_MOUNT 1
+
+extern int exclude_kernfs; /* --exclude-kernfs */
+extern int exclude_bindmounts; /* --exclude-bind-mounts */
+
+/* Adds a comma-separated list of filesystem types to exclude */
+void mount_exclude_add(const char *);
+
+/* Whether anything is excluded by filesystem type */
+int mount_active(void);
+
+/* (Re)reads the mount table, called before each scan */
+void mount_init(void);
+
+/* Returns FF_KERNFS or FF_OTHFS if the directory name in fd, on device dev,
+ * should be excluded, 0 if not or if its filesystem could not be determined.
+ * The result is kept for dev until the next mount_init(). Thread safe. */
+int mount_exclude(uint64_t dev, int fd, const char *name);
+
+/* Adds a directory that is about to be scanned, after mount_init(). Mount
+ * points in it that show a directory that is also reached through the root or
+ * another mount point are then excluded with --exclude-bind-mounts. */
+void mount_root(const char *path);
+
+/* Whether mount_bind() may exclude anything */
+int mount_binds(void);
+
+/* Returns FF_BNDMNT if the directory at path is a mount point to exclude, 0
+ * otherwise. Thread safe. */
+int mount_bind(const char *path);
+
+#endif
+
+#endif
@@ -31,6 +31,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
+#include <fcntl.h>
 
 #ifndef LINK_MAX
 # ifdef _POSIX_LINK_MAX
@@ -91,7 +92,7 @@ static int path_split(char *cur, char ***res) {
 
 /* copies path and prepends cwd if needed, to ensure an absolute path
    return value has to be free()'d manually */
-static char *path_absolute(const char *path) {
+char *path_absolute(const char *path) {
   int i, n;
   char *ret;
 
@@ -244,3 +245,30 @@ path_chdir_done:
   return r;
 }
 
+
+
+int path_open(const char *path) {
+  char **arr, *cur;
+  int i, fd, nfd, err;
+
+  if((fd = open(path, O_RDONLY|O_DIRECTORY)) >= 0 || errno != ENAMETOOLONG)
+    return fd;
+
+  /* Path too long, open one component at a time */
+  if((cur = path_absolute(path)) == NULL)
+    return -1;
+
+  i = path_split(cur, &arr);
+  fd = open("/", O_RDONLY|O_DIRECTORY);
+  while(fd >= 0 && --i >= 0) {
+    nfd = openat(fd, arr[i], O_RDONLY|O_DIRECTORY);
+    err = errno;
+    close(fd);
+    errno = err;
+    fd = nfd;
+  }
+
+  free(cur);
+  free(arr);
+  return fd;
+}
@@ -23,7 +23,7 @@
 
 */
 /*
- path.c reimplements realpath() and chdir(), both functions accept
+ path.c reimplements realpath(), chdir() and open(), all functions accept
  arbitrary long path names not limited by PATH_MAX.
 
  Caveats/bugs:
@@ -41,7 +41,16 @@
    by malloc() and should be manually free()d by the programmer. */
 extern char *path_real(const char *);
 
+/* copies path and prepends cwd if it is relative. The returned string has to
+   be free()d, NULL is returned if cwd could not be determined. */
+extern char *path_absolute(const char *);
+
 /* works exactly the same as chdir() */
 extern int   path_chdir(const char *);
 
+/* opens a directory for reading, returns a file descriptor or -1 on error.
+   Unlike path_real and path_chdir, this function is thread safe when given
+   an absolute path. */
+extern int   path_open(const char *);
+
 #endif
@@ -0,0 +1,179 @@
+/* ncdu - NCurses Disk Usage
+
+  Copyright (c) 2007-2020 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+
+#if USE_URING
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+static int uring_probe(int fd, const int *ops, int nops) {
+  struct io_uring_probe *p;
+  size_t len = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+  int i, r = 0;
+
+  p = xcalloc(1, len);
+  if(syscall(SYS_io_uring_register, fd, IORING_REGISTER_PROBE, p, 256) < 0)
+    r = -1;
+  for(i=0; !r && i<nops; i++)
+    if(ops[i] > p->last_op || !(p->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+      r = -1;
+  free(p);
+  return r;
+}
+
+
+int uring_init(struct uring *r, unsigned entries, const int *ops, int nops) {
+  struct io_uring_params p;
+  void *sqes;
+
+  memset(r, 0, sizeof(struct uring));
+  memset(&p, 0, sizeof(struct io_uring_params));
+  if((r->fd = syscall(SYS_io_uring_setup, entries, &p)) < 0)
+    return -1;
+  if(uring_probe(r->fd, ops, nops))
+    goto err;
+
+  r->entries = p.sq_entries;
+  r->sq_len = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  r->cq_len = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+
+  r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if(r->sq_ptr == MAP_FAILED)
+    goto err;
+  if(p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_ptr = r->sq_ptr;
+  else if((r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+    r->cq_ptr = NULL;
+    goto err;
+  }
+  sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(sqes == MAP_FAILED)
+    goto err;
+  r->sqes = sqes;
+
+  r->sq_head  = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+  r->sq_tail  = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+  r->sq_mask  = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+  r->cq_head  = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+  r->cq_tail  = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+  r->cq_mask  = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+  return 0;
+
+err:
+  uring_free(r);
+  return -1;
+}
+
+
+void uring_drain(struct uring *r) {
+  while(__atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head < r->inflight)
+    if(syscall(SYS_io_uring_enter, r->fd, 0, r->inflight, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+      break;
+}
+
+
+void uring_free(struct uring *r) {
+  if(r->fd >= 0 && r->cq_tail && r->inflight)
+    uring_drain(r);
+  if(r->sqes)
+    munmap(r->sqes, r->entries*sizeof(struct io_uring_sqe));
+  if(r->cq_ptr && r->cq_ptr != r->sq_ptr)
+    munmap(r->cq_ptr, r->cq_len);
+  if(r->sq_ptr && r->sq_ptr != MAP_FAILED)
+    munmap(r->sq_ptr, r->sq_len);
+  if(r->fd >= 0)
+    close(r->fd);
+  memset(r, 0, sizeof(struct uring));
+  r->fd = -1;
+}
+
+
+struct io_uring_sqe *uring_sqe(struct uring *r) {
+  unsigned tail = *r->sq_tail + r->queued;
+  struct io_uring_sqe *sqe;
+
+  if(r->queued + r->inflight >= r->entries)
+    return NULL;
+  sqe = r->sqes + (tail & *r->sq_mask);
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+  r->queued++;
+  return sqe;
+}
+
+
+int uring_wait(struct uring *r) {
+  unsigned avail, submit = r->queued;
+  long n;
+
+  /* Make the new entries visible to the kernel */
+  __atomic_store_n(r->sq_tail, *r->sq_tail + r->queued, __ATOMIC_RELEASE);
+  r->inflight += r->queued;
+  r->queued = 0;
+
+  while(submit > 0) {
+    n = syscall(SYS_io_uring_enter, r->fd, submit, 0, 0, NULL, 0);
+    if(n < 0 && errno != EINTR) {
+      /* The kernel won't look at these without another submit */
+      r->inflight -= submit;
+      return -1;
+    }
+    if(n > 0)
+      submit -= (unsigned)n;
+  }
+
+  while((avail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head) < r->inflight)
+    if(syscall(SYS_io_uring_enter, r->fd, 0, r->inflight, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+      return -1;
+  return 0;
+}
+
+
+int uring_cqe(struct uring *r, uint64_t *data, int *res) {
+  unsigned head = *r->cq_head;
+  struct io_uring_cqe *cqe;
+
+  if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+    return 0;
+  cqe = r->cqes + (head & *r->cq_mask);
+  *data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(r->cq_head, head+1, __ATOMIC_RELEASE);
+  r->inflight--;
+  return 1;
+}
+
+#endif
@@ -0,0 +1,77 @@
+/* ncdu - NCurses Disk Usage
+
+  Copyright (c) 2007-2020 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+/*
+ uring.c is a minimal interface to Linux io_uring, using the raw system calls
+ so that no additional library is needed. A ring is not thread safe, every
+ thread should have its own.
+*/
+
+#ifndef _uring_h
+#define _uring_h
+
+#if HAVE_LINUX_IO_URING_H && HAVE_SYS_SYSCALL_H && HAVE_DECL_SYS_IO_URING_SETUP && HAVE_DECL_IORING_OP_STATX
+
+#define USE_URING 1
+
+#include <linux/io_uring.h>
+
+struct uring {
+  int fd;
+  unsigned entries; /* size of the submission queue */
+  unsigned queued;  /* prepared but not yet submitted entries */
+  unsigned inflight;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_len, cq_len;
+};
+
+/* Sets up a ring with the given number of entries. Returns -1 if io_uring is
+   not available or does not support all of the nops opcodes in ops. */
+int  uring_init(struct uring *, unsigned, const int *, int);
+/* Waits for the entries in flight before releasing the ring. */
+void uring_free(struct uring *);
+
+/* Waits until the entries in flight have completed, without submitting the
+   prepared ones. To be used after uring_wait() fails, as the kernel may still
+   be writing to the memory that the entries refer to. */
+void uring_drain(struct uring *);
+
+/* Returns a zeroed submission queue entry, or NULL if the queue is full. */
+struct io_uring_sqe *uring_sqe(struct uring *);
+
+/* Submits all prepared entries and waits until all entries in flight have
+   completed. Returns -1 on error. */
+int  uring_wait(struct uring *);
+
+/* Takes a completion from the queue, returns 0 if there are none left. */
+int  uring_cqe(struct uring *, uint64_t *, int *);
+
+#endif
+
+#endif
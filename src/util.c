@@ -280,8 +280,7 @@ void uic_set(enum ui_coltype c) {
 
 /* removes item from the hlnk circular linked list and size counts of the parents */
 static void freedir_hlnk(struct dir *d) {
-  struct dir *t, *par, *pt;
-  int i;
+  struct dir *t = NULL, *par, *a = NULL, *b = NULL;
 
   if(!(d->flags & FF_HLNKC))
     return;
@@ -289,27 +288,35 @@ static void freedir_hlnk(struct dir *d) {
   /* remove size from parents.
    * This works the same as with adding: only the parents in which THIS is the
    * only occurrence of the hard link will be modified, if the same file still
-   * exists within the parent it shouldn't get removed from the count.
-   * XXX: Same note as for dir_mem.c / hlink_check():
-   *      this is probably not the most efficient algorithm */
-  for(i=1,par=d->parent; i&&par; par=par->parent) {
-    if(d->hlnk)
-      for(t=d->hlnk; i&&t!=d; t=t->hlnk)
-        for(pt=t->parent; i&&pt; pt=pt->parent)
-          if(pt==par)
-            i=0;
-    if(i) {
-      par->size = adds64(par->size, -d->size);
-      par->asize = adds64(par->size, -d->asize);
-    }
-  }
-
-  /* remove from hlnk */
+   * exists within the parent it shouldn't get removed from the count. The
+   * lists are in depth-first order (see dir_mem.c / hlink_place()), so those
+   * parents are the common parents of this link and one of its neighbours. */
   if(d->hlnk) {
     for(t=d->hlnk; t->hlnk!=d; t=t->hlnk)
       ;
-    t->hlnk = d->hlnk;
+    a = getlca(d, t);
+    b = getlca(d, d->hlnk);
+  }
+  for(par=d->parent; par && par!=a && par!=b; par=par->parent) {
+    par->size = adds64(par->size, -d->size);
+    par->asize = adds64(par->asize, -d->asize);
   }
+
+  /* and the shared sizes, the reverse of adding d after t */
+  if(d->hlnk) {
+    addsharedstats(d->parent, b, -d->size, -d->asize);
+    if(d->hlnk == t)
+      addsharedstats(t->parent, a, -t->size, -t->asize);
+    else if(a == b)
+      addsharedstats(getlca(t, d->hlnk), a, -t->size, -t->asize);
+    else if(par == a)
+      addsharedstats(a, b, t->size, t->asize);
+  }
+
+  /* remove from hlnk */
+  dir_mem_unlink(d);
+  if(d->hlnk)
+    t->hlnk = d->hlnk == t ? NULL : d->hlnk;
 }
 
 
@@ -321,6 +328,12 @@ static void freedir_rec(struct dir *dr) {
     /* remove item */
     if(tmp->sub) freedir_rec(tmp->sub);
     tmp2 = tmp->next;
+#if USE_WATCH
+    if(watch_active && tmp->flags & FF_DIR)
+      watch_forget(tmp);
+#endif
+    if(tmp->flags & FF_DIR && tmp->flags & FF_EST)
+      dir_mem_forget(tmp, 0);
     free(tmp);
   }
 }
@@ -351,6 +364,12 @@ void freedir(struct dir *dr) {
    * dir is expensive, but might be good feature to add later if desired */
   addparentstats(dr->parent, dr->flags & FF_HLNKC ? 0 : -dr->size, dr->flags & FF_HLNKC ? 0 : -dr->asize, 0, -(dr->items+1));
 
+#if USE_WATCH
+  if(watch_active && dr->flags & FF_DIR)
+    watch_forget(dr);
+#endif
+  if(dr->flags & FF_DIR && dr->flags & FF_EST)
+    dir_mem_forget(dr, 1);
   free(dr);
 }
 
@@ -385,7 +404,10 @@ const char *getpath(struct dir *cur) {
 
   dat[0] = '\0';
   while(c--) {
-    if(list[c]->parent)
+    /* The names of the roots under a virtual root are full paths */
+    if(list[c]->flags & FF_VROOT && c)
+      continue;
+    if(list[c]->parent && !(list[c]->parent->flags & FF_VROOT) && (!*dat || dat[strlen(dat)-1] != '/'))
       strcat(dat, "/");
     strcat(dat, list[c]->name);
   }
@@ -401,6 +423,26 @@ struct dir *getroot(struct dir *d) {
 }
 
 
+struct dir *getlca(struct dir *a, struct dir *b) {
+  struct dir *t;
+  int n = 0;
+
+  for(t=a; t; t=t->parent)
+    n++;
+  for(t=b; t; t=t->parent)
+    n--;
+  for(; n > 0; n--)
+    a = a->parent;
+  for(; n < 0; n++)
+    b = b->parent;
+  while(a != b) {
+    a = a->parent;
+    b = b->parent;
+  }
+  return a;
+}
+
+
 void addparentstats(struct dir *d, int64_t size, int64_t asize, uint64_t mtime, int items) {
   struct dir_ext *e;
   while(d) {
@@ -416,6 +458,24 @@ void addparentstats(struct dir *d, int64_t size, int64_t asize, uint64_t mtime,
 }
 
 
+void addsharedstats(struct dir *d, struct dir *end, int64_t size, int64_t asize) {
+  struct dir_shr *s;
+  for(; d && d!=end; d=d->parent)
+    if((s = dir_shr_ptr(d)) != NULL) {
+      s->size = adds64(s->size, size);
+      s->asize = adds64(s->asize, asize);
+    }
+}
+
+
+int64_t getshared(struct dir *d, int asize) {
+  struct dir_shr *s = dir_shr_ptr(d);
+  if(s)
+    return asize ? s->asize : s->size;
+  return d->flags & FF_HLNKC && d->hlnk ? (asize ? d->asize : d->size) : 0;
+}
+
+
 /* Apparently we can just resume drawing after endwin() and ncurses will pick
  * up where it left. Probably not very portable...  */
 #define oom_msg "\nOut of memory, press enter to try again or Ctrl-C to give up.\n"
@@ -74,11 +74,13 @@ extern int subwinr, subwinc;
 extern int si;
 
 
-/* Macros/functions for managing struct dir and struct dir_ext */
+/* Macros/functions for managing struct dir, struct dir_ext and struct dir_shr */
 
 #define dir_memsize(n)     (offsetof(struct dir, name)+1+strlen(n))
 #define dir_ext_offset(n)  ((dir_memsize(n) + 7) & ~7)
 #define dir_ext_memsize(n) (dir_ext_offset(n) + sizeof(struct dir_ext))
+#define dir_shr_offset(n, f)  ((f) & FF_EXT ? dir_ext_memsize(n) : dir_ext_offset(n))
+#define dir_shr_memsize(n, f) (dir_shr_offset(n, f) + sizeof(struct dir_shr))
 
 static inline struct dir_ext *dir_ext_ptr(struct dir *d) {
   return d->flags & FF_EXT
@@ -86,6 +88,12 @@ static inline struct dir_ext *dir_ext_ptr(struct dir *d) {
     : NULL;
 }
 
+static inline struct dir_shr *dir_shr_ptr(struct dir *d) {
+  return d->flags & FF_SHR
+    ? (struct dir_shr *) ( ((char *)d) + dir_shr_offset(d->name, d->flags) )
+    : NULL;
+}
+
 
 /* Instead of using several ncurses windows, we only draw to stdscr.
  * the functions nccreate, ncprint and the macros ncaddstr and ncaddch
@@ -153,6 +161,10 @@ const char *getpath(struct dir *);
 /* returns the root element of the given dir struct */
 struct dir *getroot(struct dir *);
 
+/* returns the deepest element that has both given dir structs below it, or
+ * NULL if they are in different trees */
+struct dir *getlca(struct dir *, struct dir *);
+
 /* Add two signed 64-bit integers. Returns INT64_MAX if the result would
  * overflow, or 0 if it would be negative. At least one of the integers must be
  * positive.
@@ -165,6 +177,14 @@ struct dir *getroot(struct dir *);
 /* Adds a value to the size, asize and items fields of *d and its parents */
 void addparentstats(struct dir *, int64_t, int64_t, uint64_t, int);
 
+/* Adds a value to the shared size and asize of *d and its parents, up to but
+ * not including the second argument. See dir_mem.c / hlink_check() */
+void addsharedstats(struct dir *, struct dir *, int64_t, int64_t);
+
+/* Returns the shared size (or asize, if the second argument is set) of an
+ * item: the part of its size that deleting it wouldn't free */
+int64_t getshared(struct dir *, int);
+
 
 /* A simple stack implemented in macros */
 #define nstack_init(_s) do {\
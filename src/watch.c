@@ -0,0 +1,447 @@
+/* ncdu - NCurses Disk Usage
+
+  Copyright (c) 2007-2020 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#include "global.h"
+
+#if USE_WATCH
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#if HAVE_SYS_FANOTIFY_H && HAVE_SYS_STATFS_H && HAVE_FANOTIFY_INIT && HAVE_OPEN_BY_HANDLE_AT
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+# ifdef FAN_REPORT_DFID_NAME
+#  define WATCH_FANOTIFY 1
+# endif
+#endif
+
+#include <khashl.h>
+
+
+/* set S_BLKSIZE if not defined already in sys/stat.h */
+#ifndef S_BLKSIZE
+# define S_BLKSIZE 512
+#endif
+
+#define INOTIFY_MASK (IN_CREATE|IN_DELETE|IN_MOVED_FROM|IN_MOVED_TO|IN_MODIFY|IN_ONLYDIR|IN_DONT_FOLLOW|IN_EXCL_UNLINK)
+
+
+int watch_enabled = 0;
+int watch_limit = 65536;
+int watch_active = 0;
+int watch_stale = 0;
+
+
+/* After the scan, every directory in the tree is watched for changes to its
+ * entries. When an entry changes, it is stat()ed again and the difference in
+ * size is applied to the tree. Where permitted, fanotify is used to watch
+ * entire filesystems at once; every other directory gets an inotify watch,
+ * up to watch_limit directories.
+ *
+ * Limitations: changes to hard links that have been found more than once are
+ * ignored, since their sizes are shared between directories, and directories
+ * that are moved into the tree are added without their contents. When the
+ * kernel drops events because its queue is full, the tree is marked as stale
+ * until the top directory is refreshed. */
+
+/* inotify watch descriptor -> directory, and the reverse */
+#define ptr_hash(p) kh_hash_uint64((khint64_t)(uintptr_t)(p))
+KHASHL_MAP_INIT(KH_LOCAL, wd_t, wd, int, struct dir *, kh_hash_uint32, kh_eq_generic)
+KHASHL_MAP_INIT(KH_LOCAL, dw_t, dw, struct dir *, int, ptr_hash, kh_eq_generic)
+
+static wd_t *wds;
+static dw_t *dws;
+static int ifd = -1, nwatches;
+
+/* Last item that has been updated in this poll, to skip repeated events for
+ * the same item */
+static struct dir *lastdir;
+static char *lastname;
+
+/* Directory to open in the browser, if the current one has been removed. It
+ * takes the place of dirlist_par once set, since that has been freed. */
+static struct dir *reopen;
+
+#if WATCH_FANOTIFY
+
+#define FANOTIFY_MASK (FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO|FAN_MODIFY|FAN_ONDIR)
+
+/* Directories on filesystems that have been marked with fanotify, indexed by
+ * (dev, ino) */
+#define dino_hash(d)     (kh_hash_uint64((khint64_t)d->dev) ^ kh_hash_uint64((khint64_t)d->ino))
+#define dino_equal(a, b) ((a)->dev == (b)->dev && (a)->ino == (b)->ino)
+KHASHL_SET_INIT(KH_LOCAL, di_t, di, struct dir *, dino_hash, dino_equal)
+
+static di_t *dirs;
+static int ffd = -1;
+static struct dir *dkey; /* scratch key for lookups */
+
+static struct watch_fs {
+  uint64_t dev;
+  fsid_t fsid;
+  int fd; /* a directory on the filesystem, -1 if it could not be marked */
+} *fss;
+static int nfss;
+
+
+/* Returns whether the filesystem of dev is watched with fanotify, trying to
+ * mark it if we haven't seen it before. path is a directory on dev. */
+static int fan_fs(uint64_t dev, const char *path) {
+  struct watch_fs *fs;
+  struct statfs st;
+  int i;
+
+  for(i=0; i<nfss; i++)
+    if(fss[i].dev == dev)
+      return fss[i].fd >= 0;
+
+  fss = xrealloc(fss, (nfss+1)*sizeof(struct watch_fs));
+  fs = fss + nfss++;
+  fs->dev = dev;
+  fs->fd = -1;
+  if(ffd < 0 || fanotify_mark(ffd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, path))
+    return 0;
+  if((fs->fd = open(path, O_RDONLY|O_DIRECTORY)) >= 0 && fstatfs(fs->fd, &st)) {
+    close(fs->fd);
+    fs->fd = -1;
+  }
+  if(fs->fd < 0) {
+    fanotify_mark(ffd, FAN_MARK_REMOVE|FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, path);
+    return 0;
+  }
+  fs->fsid = st.f_fsid;
+  return 1;
+}
+
+#endif
+
+
+static void watch_dir(struct dir *d) {
+  const char *path;
+  khint_t k;
+  int w, absent;
+
+  if(d->flags & FF_VROOT)
+    return;
+  path = getpath(d);
+
+#if WATCH_FANOTIFY
+  if(fan_fs(d->dev, path)) {
+    k = di_put(dirs, d, &absent);
+    kh_key(dirs, k) = d;
+    watch_active = 1;
+    return;
+  }
+#endif
+
+  if(ifd < 0 || nwatches >= watch_limit)
+    return;
+  if((w = inotify_add_watch(ifd, path, INOTIFY_MASK)) < 0) {
+    if(errno == ENOSPC)
+      watch_limit = nwatches;
+    return;
+  }
+  k = wd_put(wds, w, &absent);
+  kh_val(wds, k) = d;
+  if(absent)
+    nwatches++;
+  k = dw_put(dws, d, &absent);
+  kh_val(dws, k) = w;
+  watch_active = 1;
+}
+
+
+void watch_add(struct dir *root) {
+  struct dir **queue, *t;
+  size_t qs = 64, qn = 0, qi;
+
+  if(!watch_enabled)
+    return;
+  if(!root->parent)
+    watch_stale = 0;
+  if(!wds) {
+    wds = wd_init();
+    dws = dw_init();
+    ifd = inotify_init1(IN_NONBLOCK);
+#if WATCH_FANOTIFY
+    dirs = di_init();
+    dkey = xcalloc(1, dir_memsize(""));
+    ffd = fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME|FAN_NONBLOCK, O_RDONLY);
+#endif
+  }
+
+  /* Breadth-first, so that the upper directories get a watch if the budget
+   * doesn't cover the entire tree */
+  queue = xmalloc(qs*sizeof(struct dir *));
+  queue[qn++] = root;
+  for(qi=0; qi<qn; qi++) {
+    watch_dir(queue[qi]);
+    for(t=queue[qi]->sub; t; t=t->next)
+      if(t->flags & FF_DIR && !(t->flags & (FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK|FF_BNDMNT|FF_AGGR))) {
+        if(qn == qs) {
+          qs *= 2;
+          queue = xrealloc(queue, qs*sizeof(struct dir *));
+        }
+        queue[qn++] = t;
+      }
+  }
+  free(queue);
+}
+
+
+void watch_forget(struct dir *d) {
+  khint_t k;
+  int w;
+
+  if(d == lastdir)
+    lastdir = NULL;
+
+#if WATCH_FANOTIFY
+  if(dirs && (k = di_get(dirs, d)) != kh_end(dirs) && kh_key(dirs, k) == d)
+    di_del(dirs, k);
+#endif
+
+  if(dws && (k = dw_get(dws, d)) != kh_end(dws)) {
+    w = kh_val(dws, k);
+    dw_del(dws, k);
+    if((k = wd_get(wds, w)) != kh_end(wds) && kh_val(wds, k) == d) {
+      wd_del(wds, k);
+      inotify_rm_watch(ifd, w);
+      nwatches--;
+    }
+  }
+}
+
+
+/* Removes d from the tree. When the directory that is shown, or the one that
+ * is going to be shown instead, is d or below it, the parent of d is opened
+ * after the poll. This way reopen always points into the remaining tree, also
+ * when a directory and one of its parents are removed in the same poll. */
+static void watch_remove(struct dir *d) {
+  struct dir *t;
+  for(t=reopen ? reopen : dirlist_par; t && t!=d; t=t->parent)
+    ;
+  if(t)
+    reopen = d->parent;
+  freedir(d);
+}
+
+
+/* Adds a new item to par, with the information from st */
+static void watch_new(struct dir *par, const char *name, const char *path, struct stat *st) {
+  struct dir *d;
+
+  d = xcalloc(1, extended_info ? dir_ext_memsize(name) : dir_memsize(name));
+  strcpy(d->name, name);
+  d->ino = (uint64_t)st->st_ino;
+  d->dev = (uint64_t)st->st_dev;
+
+  if(S_ISREG(st->st_mode))
+    d->flags |= FF_FILE;
+  else if(S_ISDIR(st->st_mode))
+    d->flags |= FF_DIR;
+  if(!S_ISDIR(st->st_mode) && st->st_nlink > 1)
+    d->flags |= FF_HLNKC;
+
+  if(exclude_match((char *)path))
+    d->flags = FF_EXL;
+  else if(dir_scan_smfs && d->dev != par->dev)
+    d->flags |= FF_OTHFS;
+  else {
+    d->size = st->st_blocks * S_BLKSIZE;
+    d->asize = st->st_size;
+  }
+
+  if(extended_info && !(d->flags & FF_EXL)) {
+    d->flags |= FF_EXT;
+    dir_ext_ptr(d)->mode = st->st_mode;
+    dir_ext_ptr(d)->mtime = st->st_mtime;
+    dir_ext_ptr(d)->uid = (int)st->st_uid;
+    dir_ext_ptr(d)->gid = (int)st->st_gid;
+  }
+
+  d->parent = par;
+  d->next = par->sub;
+  if(d->next)
+    d->next->prev = d;
+  par->sub = d;
+  addparentstats(par, d->size, d->asize, d->flags & FF_EXT ? dir_ext_ptr(d)->mtime : 0, 1);
+
+  if(d->flags & FF_DIR && !(d->flags & (FF_EXL|FF_OTHFS)))
+    watch_dir(d);
+}
+
+
+/* Updates the item with the given name in par. Returns whether anything has
+ * changed. */
+static int watch_update(struct dir *par, const char *name) {
+  struct dir *d;
+  struct stat st;
+  char *path;
+  const char *ppath;
+  int64_t size, asize;
+  int changed = 1;
+
+  if(name[0] == 0 || (name[0] == '.' && name[1] == 0))
+    return 0;
+  if(par == lastdir && strcmp(name, lastname) == 0)
+    return 0;
+
+  for(d=par->sub; d; d=d->next)
+    if(strcmp(d->name, name) == 0)
+      break;
+
+  ppath = getpath(par);
+  path = xmalloc(strlen(ppath)+strlen(name)+2);
+  strcpy(path, ppath);
+  if(ppath[1])
+    strcat(path, "/");
+  strcat(path, name);
+
+  if(lstat(path, &st)) {
+    if(d)
+      watch_remove(d);
+    else
+      changed = 0;
+    free(path);
+    return changed;
+  }
+
+  if(!d)
+    watch_new(par, name, path, &st);
+  else if(!!(d->flags & FF_DIR) != !!S_ISDIR(st.st_mode)) {
+    watch_remove(d);
+    watch_new(par, name, path, &st);
+  } else if(!(d->flags & (FF_DIR|FF_EXL|FF_OTHFS|FF_KERNFS|FF_FRMLNK|FF_BNDMNT)) && !(d->flags & FF_HLNKC && d->hlnk)) {
+    size = st.st_blocks * S_BLKSIZE;
+    asize = st.st_size;
+    if(d->flags & FF_EXT)
+      dir_ext_ptr(d)->mtime = st.st_mtime;
+    addparentstats(par, size - d->size, asize - d->asize, d->flags & FF_EXT ? dir_ext_ptr(d)->mtime : 0, 0);
+    d->size = size;
+    d->asize = asize;
+    d->flags &= ~FF_EST;
+  } else
+    changed = 0;
+  free(path);
+
+  lastdir = par;
+  free(lastname);
+  lastname = xmalloc(strlen(name)+1);
+  strcpy(lastname, name);
+  return changed;
+}
+
+
+static int inotify_poll(void) {
+  char buf[16*1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  ssize_t len, i;
+  khint_t k;
+  int changed = 0;
+
+  while((len = read(ifd, buf, sizeof(buf))) > 0)
+    for(i=0; i<len; i+=sizeof(struct inotify_event)+ev->len) {
+      ev = (struct inotify_event *)(buf+i);
+      if(ev->mask & IN_Q_OVERFLOW)
+        watch_stale = changed = 1;
+      else if(ev->len && (k = wd_get(wds, ev->wd)) != kh_end(wds))
+        changed |= watch_update(kh_val(wds, k), ev->name);
+    }
+  return changed;
+}
+
+
+#if WATCH_FANOTIFY
+
+static int fanotify_poll(void) {
+  char buf[16*1024] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+  struct fanotify_event_metadata *m;
+  struct fanotify_event_info_fid *fid;
+  struct file_handle *fh;
+  struct stat st;
+  ssize_t len;
+  khint_t k;
+  int i, fd, changed = 0;
+
+  while((len = read(ffd, buf, sizeof(buf))) > 0)
+    for(m=(struct fanotify_event_metadata *)buf; FAN_EVENT_OK(m, len); m=FAN_EVENT_NEXT(m, len)) {
+      if(m->fd >= 0)
+        close(m->fd);
+      if(m->mask & FAN_Q_OVERFLOW) {
+        watch_stale = changed = 1;
+        continue;
+      }
+      fid = (struct fanotify_event_info_fid *)(m+1);
+      if(m->vers != FANOTIFY_METADATA_VERSION || m->event_len <= sizeof(*m) || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+        continue;
+      fh = (struct file_handle *)fid->handle;
+
+      for(i=0; i<nfss; i++)
+        if(fss[i].fd >= 0 && memcmp(&fss[i].fsid, &fid->fsid, sizeof(fsid_t)) == 0)
+          break;
+      if(i == nfss || (fd = open_by_handle_at(fss[i].fd, fh, O_PATH)) < 0)
+        continue;
+      if(!fstat(fd, &st)) {
+        dkey->dev = (uint64_t)st.st_dev;
+        dkey->ino = (uint64_t)st.st_ino;
+        if((k = di_get(dirs, dkey)) != kh_end(dirs))
+          changed |= watch_update(kh_key(dirs, k), (char *)fh->f_handle + fh->handle_bytes);
+      }
+      close(fd);
+    }
+  return changed;
+}
+
+#endif
+
+
+void watch_poll(void) {
+  int changed = 0;
+
+  if(!watch_active)
+    return;
+
+  reopen = NULL;
+  lastdir = NULL;
+  if(ifd >= 0)
+    changed |= inotify_poll();
+#if WATCH_FANOTIFY
+  if(ffd >= 0)
+    changed |= fanotify_poll();
+#endif
+
+  if(reopen)
+    browse_init(reopen);
+  else if(changed)
+    dirlist_open(dirlist_par);
+}
+
+#endif
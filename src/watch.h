@@ -0,0 +1,50 @@
+/* ncdu - NCurses Disk Usage
+
+  Copyright (c) 2007-2020 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#ifndef _watch_h
+#define _watch_h
+
+#if HAVE_SYS_INOTIFY_H && HAVE_INOTIFY_INIT1
+
+#define USE_WATCH 1
+
+extern int watch_enabled; /* --watch */
+extern int watch_limit;   /* maximum number of inotify watches */
+extern int watch_active;  /* whether any directory is being watched */
+extern int watch_stale;   /* whether events have been lost since the top directory was scanned */
+
+/* Starts watching the given directory and everything below it. Called by
+   dir_mem.c after a successful scan or refresh. */
+void watch_add(struct dir *);
+
+/* Stops watching a directory, called by freedir() */
+void watch_forget(struct dir *);
+
+/* Applies all pending change events to the tree */
+void watch_poll(void);
+
+#endif
+
+#endif
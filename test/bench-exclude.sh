@@ -0,0 +1,90 @@
+#!/bin/sh
+# Benchmark for --exclude-from (-X) with a long list of patterns.
+#
+# usage: test/bench-exclude.sh NCDU...
+#
+# Generates a tree with files many levels deep and a list of patterns of the
+# kinds that are matched in different ways (names, *.ext, prefix*, paths and
+# wildcards in the middle), then scans it with each of the given ncdu
+# binaries, with and without the list. Prints the best of RUNS scans and the
+# time the patterns add per item.
+#
+# The size of the benchmark can be set in the environment:
+#   BRANCHES  directory chains below the top directory (40)
+#   DEPTH     directories in each chain (13)
+#   FILES     files in each directory (40)
+#   PATTERNS  number of patterns (3000)
+#   RUNS      scans per binary, the fastest one counts (3)
+
+BRANCHES=${BRANCHES:-40}
+DEPTH=${DEPTH:-13}
+FILES=${FILES:-40}
+PATTERNS=${PATTERNS:-3000}
+RUNS=${RUNS:-3}
+
+if [ $# -eq 0 ]; then
+  echo "usage: $0 NCDU..." >&2
+  exit 2
+fi
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/ncdu-bench-XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+# The file names, the same in every directory. One in four is a .o, which
+# the pattern list excludes.
+NAMES=$(awk -v n="$FILES" 'BEGIN { split("c h txt o", e); for(i=0; i<n; i++) print "file" i "." e[i%4+1] }')
+
+mkdir "$DIR/tree"
+b=0
+while [ $b -lt "$BRANCHES" ]; do
+  d="$DIR/tree/branch$b"
+  l=0
+  while [ $l -lt "$DEPTH" ]; do
+    mkdir "$d"
+    (cd "$d" && touch $NAMES)
+    d="$d/level$l"
+    l=$((l+1))
+  done
+  b=$((b+1))
+done
+ITEMS=$((BRANCHES * DEPTH * (FILES + 1) + 1))
+
+# Random patterns that don't match anything in the tree, plus *.o
+awk -v n="$PATTERNS" 'BEGIN {
+  srand(1)
+  for(i=0; i<n; i++) {
+    w = ""; v = ""
+    for(j=0; j<4+int(rand()*6); j++) w = w sprintf("%c", 97+int(rand()*26))
+    for(j=0; j<4+int(rand()*6); j++) v = v sprintf("%c", 97+int(rand()*26))
+    k = i % 5
+    if(k == 0)      print w
+    else if(k == 1) print "*." substr(w, 1, 4)
+    else if(k == 2) print w "*"
+    else if(k == 3) print w "/" v
+    else            print "*" w "?" v "*"
+  }
+  print "*.o"
+}' > "$DIR/patterns"
+
+# Prints the fastest of RUNS scans in ms
+best() {
+  min=
+  r=0
+  while [ $r -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$@" >/dev/null || return 1
+    ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    if [ -z "$min" ] || [ $ms -lt $min ]; then
+      min=$ms
+    fi
+    r=$((r+1))
+  done
+  echo $min
+}
+
+echo "$ITEMS items, $((PATTERNS + 1)) patterns"
+for ncdu in "$@"; do
+  plain=$(best "$ncdu" -0 -o /dev/null "$DIR/tree") || exit 1
+  excl=$(best "$ncdu" -0 -o /dev/null -X "$DIR/patterns" "$DIR/tree") || exit 1
+  echo "$ncdu: $plain ms, $excl ms with -X, $(( (excl - plain) * 1000000 / ITEMS )) ns per item"
+done
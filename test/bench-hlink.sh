@@ -0,0 +1,79 @@
+#!/bin/sh
+# Benchmark for the counting of hard links, with a tree of snapshots as backup
+# tools like rsnapshot make them.
+#
+# usage: test/bench-hlink.sh NCDU...
+#
+# Generates a tree with files many levels deep and copies it with cp -al, so
+# that every file is a hard link shared by all snapshots, plus a file of its
+# own in each directory of every snapshot. Scans it with each of the given
+# ncdu binaries and prints the best of RUNS scans and the time per item.
+#
+# The size of the benchmark can be set in the environment:
+#   BRANCHES   directory chains in each snapshot (10)
+#   DEPTH      directories in each chain (12)
+#   FILES      files in each directory (20)
+#   SNAPSHOTS  number of snapshots (40)
+#   RUNS       scans per binary, the fastest one counts (3)
+
+BRANCHES=${BRANCHES:-10}
+DEPTH=${DEPTH:-12}
+FILES=${FILES:-20}
+SNAPSHOTS=${SNAPSHOTS:-40}
+RUNS=${RUNS:-3}
+
+if [ $# -eq 0 ]; then
+  echo "usage: $0 NCDU..." >&2
+  exit 2
+fi
+
+DIR=$(mktemp -d "${TMPDIR:-/tmp}/ncdu-bench-XXXXXX") || exit 1
+trap 'rm -rf "$DIR"' EXIT INT TERM
+
+NAMES=$(awk -v n="$FILES" 'BEGIN { for(i=0; i<n; i++) print "file" i }')
+
+mkdir -p "$DIR/tree/snap0"
+b=0
+while [ $b -lt "$BRANCHES" ]; do
+  d="$DIR/tree/snap0/branch$b"
+  l=0
+  while [ $l -lt "$DEPTH" ]; do
+    mkdir "$d"
+    (cd "$d" && for f in $NAMES; do echo "$f" >"$f"; done)
+    d="$d/level$l"
+    l=$((l+1))
+  done
+  b=$((b+1))
+done
+
+s=1
+while [ $s -lt "$SNAPSHOTS" ]; do
+  cp -al "$DIR/tree/snap0" "$DIR/tree/snap$s" || exit 1
+  s=$((s+1))
+done
+find "$DIR/tree" -mindepth 2 -type d -exec sh -c 'for d; do echo >"$d/own"; done' sh {} +
+ITEMS=$(find "$DIR/tree" | wc -l)
+
+# Prints the fastest of RUNS scans in ms. Without -o the tree is kept in
+# memory, which is where the links are counted; ncdu exits after the scan as
+# the browser needs a terminal.
+best() {
+  min=
+  r=0
+  while [ $r -lt "$RUNS" ]; do
+    start=$(date +%s%N)
+    "$@" </dev/null >/dev/null 2>&1
+    ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    if [ -z "$min" ] || [ $ms -lt $min ]; then
+      min=$ms
+    fi
+    r=$((r+1))
+  done
+  echo $min
+}
+
+echo "$ITEMS items, $SNAPSHOTS links to each of $((BRANCHES * DEPTH * FILES)) files"
+for ncdu in "$@"; do
+  ms=$(best "$ncdu" -0 "$DIR/tree")
+  echo "$ncdu: $ms ms, $(( ms * 1000000 / ITEMS )) ns per item"
+done
@@ -0,0 +1,281 @@
+/* ncdu - NCurses Disk Usage
+
+  Copyright (c) 2007-2020 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+/* Scans snapshots of a tree that share most of their files through hard links,
+ * as backup tools like rsnapshot make them, with some more links within and
+ * between the snapshots. The size and the shared size of every directory are
+ * checked against a count from scratch, after the scan and after refreshing
+ * or removing random parts of the tree. */
+
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define SNAPSHOTS 5
+#define MAXDIRS 60
+#define MAXFILES 300
+#define STEPS 100
+
+static char path[64];
+
+/* The directories and files of the first snapshot, relative to it */
+static char *dirs[MAXDIRS], *files[MAXFILES];
+static int ndirs, nfiles;
+
+static struct link {
+  uint64_t dev, ino;
+  int64_t size, asize;
+} *links, *all;
+static int nlinks, slinks, nall;
+
+static struct dir **items;
+static int nitems, sitems;
+
+
+static void cleanup(void) {
+  char cmd[80];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+  system(cmd);
+}
+
+
+static char *copy(const char *s) {
+  return strcpy(xmalloc(strlen(s)+1), s);
+}
+
+
+static int write_file(const char *fn) {
+  static char data[16384];
+  FILE *f;
+  size_t n = rand() % sizeof(data);
+
+  return (f = fopen(fn, "w")) == NULL || fwrite(data, 1, n, f) != n || fclose(f);
+}
+
+
+static int generate(const char *dir, int depth) {
+  char p[96];
+  int i, n = 3 + rand() % 8;
+
+  snprintf(p, sizeof(p), "%s/s0/%s", path, dir);
+  if(mkdir(p, 0700))
+    return 1;
+  dirs[ndirs++] = copy(dir);
+  for(i=0; i<n; i++) {
+    if(depth < 5 && rand() % (depth+2) == 0 && ndirs < MAXDIRS) {
+      snprintf(p, sizeof(p), "%s%sd%d", dir, *dir ? "/" : "", i);
+      if(generate(p, depth+1))
+        return 1;
+    } else if(nfiles < MAXFILES) {
+      snprintf(p, sizeof(p), "%s%sf%d", dir, *dir ? "/" : "", i);
+      files[nfiles] = copy(p);
+      snprintf(p, sizeof(p), "%s/s0/%s", path, files[nfiles++]);
+      if(write_file(p))
+        return 1;
+    }
+  }
+  return 0;
+}
+
+
+/* Each snapshot links to the files of the one before, except for the files
+ * that have changed in between. Returns 77 if hard links aren't supported. */
+static int snapshots(void) {
+  char p[96], q[96];
+  int s, i;
+
+  for(s=1; s<SNAPSHOTS; s++) {
+    for(i=0; i<ndirs; i++) {
+      snprintf(p, sizeof(p), "%s/s%d/%s", path, s, dirs[i]);
+      if(mkdir(p, 0700))
+        return 99;
+    }
+    for(i=0; i<nfiles; i++) {
+      snprintf(p, sizeof(p), "%s/s%d/%s", path, s-1, files[i]);
+      snprintf(q, sizeof(q), "%s/s%d/%s", path, s, files[i]);
+      if(rand() % 5 == 0 ? write_file(q) : link(p, q))
+        return errno == EPERM || errno == ENOTSUP ? 77 : 99;
+    }
+  }
+  for(i=0; i<nfiles/4; i++) {
+    snprintf(p, sizeof(p), "%s/s%d/%s", path, rand() % SNAPSHOTS, files[rand() % nfiles]);
+    snprintf(q, sizeof(q), "%s/s%d/%s/l%d", path, rand() % SNAPSHOTS, dirs[rand() % ndirs], i);
+    if(link(p, q))
+      return 99;
+  }
+  return 0;
+}
+
+
+static void collect(struct dir *d) {
+  if(nitems == sitems)
+    items = xrealloc(items, (sitems = sitems ? sitems*2 : 1024) * sizeof(*items));
+  items[nitems++] = d;
+  for(d=d->sub; d; d=d->next)
+    collect(d);
+}
+
+
+static int link_cmp(const void *a, const void *b) {
+  const struct link *x = a, *y = b;
+  return x->dev != y->dev ? (x->dev < y->dev ? -1 : 1) : x->ino != y->ino ? (x->ino < y->ino ? -1 : 1) : 0;
+}
+
+
+/* Adds the sizes below d to *size and *asize, except for hard links, which are
+ * added to links instead. Directories have their own size on disk. */
+static void count(struct dir *d, int64_t *size, int64_t *asize) {
+  struct stat st;
+
+  if(d->flags & FF_DIR) {
+    if(lstat(getpath(d), &st) == 0) {
+      *size += st.st_blocks * 512;
+      *asize += st.st_size;
+    }
+    for(d=d->sub; d; d=d->next)
+      count(d, size, asize);
+  } else if(d->flags & FF_HLNKC) {
+    if(nlinks == slinks)
+      links = xrealloc(links, (slinks = slinks ? slinks*2 : 1024) * sizeof(*links));
+    links[nlinks].dev = d->dev;
+    links[nlinks].ino = d->ino;
+    links[nlinks].size = d->size;
+    links[nlinks++].asize = d->asize;
+  } else {
+    *size += d->size;
+    *asize += d->asize;
+  }
+}
+
+
+/* Number of links to the same file as l in the whole tree */
+static int total(struct link *l) {
+  struct link *a = bsearch(l, all, nall, sizeof(*all), link_cmp), *b;
+  for(; a>all && !link_cmp(a-1, l); a--)
+    ;
+  for(b=a; b<all+nall && !link_cmp(b, l); b++)
+    ;
+  return b-a;
+}
+
+
+/* Each file counts once in a directory, and is shared if it has links outside
+ * of the directory. */
+static int check_dir(struct dir *d, const char *when) {
+  int64_t size = 0, asize = 0, shared = 0, ashared = 0;
+  int i, n;
+
+  nlinks = 0;
+  count(d, &size, &asize);
+  qsort(links, nlinks, sizeof(*links), link_cmp);
+  for(i=0; i<nlinks; i+=n) {
+    for(n=1; i+n<nlinks && !link_cmp(links+i, links+i+n); n++)
+      ;
+    size += links[i].size;
+    asize += links[i].asize;
+    if(n < total(links+i)) {
+      shared += links[i].size;
+      ashared += links[i].asize;
+    }
+  }
+  if(d->size == size && d->asize == asize && getshared(d, 0) == shared && getshared(d, 1) == ashared)
+    return 0;
+  fprintf(stderr, "%s: %s: size %"PRId64" asize %"PRId64" shared %"PRId64" %"PRId64
+    ", expected %"PRId64" %"PRId64" %"PRId64" %"PRId64"\n", when, getpath(d),
+    d->size, d->asize, getshared(d, 0), getshared(d, 1), size, asize, shared, ashared);
+  return 1;
+}
+
+
+static int check(struct dir *root, const char *when) {
+  int64_t size = 0, asize = 0;
+  int i, r = 0;
+
+  nlinks = 0;
+  count(root, &size, &asize);
+  all = xrealloc(all, (nlinks+1) * sizeof(*all));
+  memcpy(all, links, nlinks * sizeof(*all));
+  nall = nlinks;
+  qsort(all, nall, sizeof(*all), link_cmp);
+
+  nitems = 0;
+  collect(root);
+  for(i=0; i<nitems; i++)
+    if(items[i]->flags & FF_DIR && check_dir(items[i], when) && ++r >= 5)
+      break;
+  return r;
+}
+
+
+static struct dir *scan(struct dir *d, const char *p) {
+  dir_mem_init(d);
+  dir_scan_init(p);
+  if(dir_process() || !dirlist_par) {
+    fprintf(stderr, "scan of %s failed: %s\n", p, dir_fatalerr ? dir_fatalerr : "no tree");
+    return NULL;
+  }
+  return getroot(dirlist_par);
+}
+
+
+int main(void) {
+  struct dir *root, *d;
+  char p[96];
+  int i, r = 0;
+
+  strcpy(path, "/tmp/ncdu-hlink-XXXXXX");
+  if(!mkdtemp(path))
+    return 99;
+  atexit(cleanup);
+  srand(1);
+  if(generate("", 0) || (r = snapshots()) != 0)
+    return r ? r : 99;
+
+  dir_ui = 0;
+  if(!(root = scan(NULL, path)))
+    return 1;
+  if(check(root, "scan"))
+    return 1;
+
+  for(i=0; i<STEPS; i++) {
+    nitems = 0;
+    collect(root);
+    d = items[rand() % nitems];
+    if(d->flags & FF_DIR && rand() % 2) {
+      strcpy(p, getpath(d));
+      if(!(root = scan(d, p)) || check(root, "refresh"))
+        return 1;
+    } else if(d != root) {
+      freedir(d);
+      if(check(root, "remove"))
+        return 1;
+    }
+  }
+  freedir(root);
+  return 0;
+}
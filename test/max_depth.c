@@ -0,0 +1,116 @@
+/* ncdu - NCurses Disk Usage
+
+  Copyright (c) 2007-2020 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+/* Imports trees with links to the same file above and below --max-depth, in
+ * different orders. The file should be counted once in every directory that
+ * contains a link to it, whether the link has been stored or aggregated. */
+
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define D 4096
+#define F 1048576
+
+#define HEAD "[1,1,{\"progname\":\"ncdu\",\"progver\":\"test\",\"timestamp\":0},\n"
+#define TOP  "[{\"name\":\"md5\",\"asize\":4096,\"dsize\":4096,\"dev\":1,\"ino\":1}"
+#define DIR(n, i) "[{\"name\":\"" n "\",\"asize\":4096,\"dsize\":4096,\"ino\":" #i "}"
+#define LINK(n)   "{\"name\":\"" n "\",\"asize\":1048576,\"dsize\":1048576,\"ino\":99,\"hlnkc\":true}"
+
+static char path[64];
+
+static const struct {
+  const char *tree;
+  int64_t md5, d5, d6; /* expected sizes, 0 if not in the tree */
+} trees[] = {
+  /* md5/{d5/x/file, l5} */
+  { HEAD TOP ",\n" DIR("d5", 2) "," DIR("x", 3) "," LINK("file") "]],\n" LINK("l5") "]]\n",
+    3*D+F, 2*D+F, 0 },
+  /* md5/{l5, d5/x/file} */
+  { HEAD TOP ",\n" LINK("l5") ",\n" DIR("d5", 2) "," DIR("x", 3) "," LINK("file") "]]]]\n",
+    3*D+F, 2*D+F, 0 },
+  /* md5/{d5/x/file, d6/x/file} */
+  { HEAD TOP ",\n" DIR("d5", 2) "," DIR("x", 3) "," LINK("file") "]],\n" DIR("d6", 4) "," DIR("x", 5) "," LINK("file") "]]]]\n",
+    5*D+F, 2*D+F, 2*D+F },
+  /* md5/{d5/{x/file, y/file}, l5} */
+  { HEAD TOP ",\n" DIR("d5", 2) "," DIR("x", 3) "," LINK("file") "]," DIR("y", 4) "," LINK("file") "]],\n" LINK("l5") "]]\n",
+    4*D+F, 3*D+F, 0 },
+  /* md5/{d5/x/file, l5, d6/x/file} */
+  { HEAD TOP ",\n" DIR("d5", 2) "," DIR("x", 3) "," LINK("file") "]],\n" LINK("l5") ",\n" DIR("d6", 4) "," DIR("x", 5) "," LINK("file") "]]]]\n",
+    5*D+F, 2*D+F, 2*D+F }
+};
+
+static void cleanup(void) {
+  unlink(path);
+}
+
+static int check_size(struct dir *d, int64_t want) {
+  if(d->size == want && d->asize == want)
+    return 0;
+  fprintf(stderr, "%s: expected %"PRId64" bytes, got %"PRId64" (asize %"PRId64")\n",
+    d->name[0] ? d->name : "md5", want, d->size, d->asize);
+  return 1;
+}
+
+static int check(int i) {
+  struct dir *root, *d;
+  FILE *f;
+  int r;
+
+  if(!(f = fopen(path, "w")) || fputs(trees[i].tree, f) < 0 || fclose(f))
+    return 99;
+  dir_mem_init(NULL);
+  if(dir_import_init(path) || dir_process() || !(root = dirlist_par))
+    return 99;
+  r = check_size(root, trees[i].md5);
+  for(d=root->sub; d; d=d->next)
+    if(strcmp(d->name, "d5") == 0)
+      r |= check_size(d, trees[i].d5);
+    else if(strcmp(d->name, "d6") == 0)
+      r |= check_size(d, trees[i].d6);
+  if(r)
+    fprintf(stderr, "in tree %d\n", i+1);
+  freedir(root);
+  return r;
+}
+
+int main(void) {
+  int fd, r;
+  size_t i;
+
+  strcpy(path, "/tmp/ncdu-max-depth-XXXXXX");
+  if((fd = mkstemp(path)) < 0)
+    return 99;
+  close(fd);
+  atexit(cleanup);
+
+  dir_ui = 0;
+  dir_mem_max_depth = 1;
+  for(i=0; i<sizeof(trees)/sizeof(*trees); i++)
+    if((r = check(i)) != 0)
+      return r;
+  return 0;
+}
@@ -0,0 +1,86 @@
+/* ncdu - NCurses Disk Usage
+
+  Copyright (c) 2007-2020 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+/* Scans two roots given relative to the current directory. Both should be
+ * found, although resolving the first one changes the current directory. */
+
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static char path[64];
+
+static void cleanup(void) {
+  char cmd[80];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+  system(cmd);
+}
+
+static struct dir *sub(struct dir *d, const char *name) {
+  for(d=d->sub; d; d=d->next)
+    if(strcmp(d->name, name) == 0)
+      return d;
+  return NULL;
+}
+
+int main(void) {
+  char *paths[] = { "x/a", "y/b" }, p[96];
+  struct dir *root;
+  FILE *f;
+
+  strcpy(path, "/tmp/ncdu-roots-XXXXXX");
+  if(!mkdtemp(path))
+    return 99;
+  atexit(cleanup);
+  snprintf(p, sizeof(p), "%s/x", path);
+  if(mkdir(p, 0700) || chdir(p) || mkdir("a", 0700))
+    return 99;
+  snprintf(p, sizeof(p), "%s/y", path);
+  if(mkdir(p, 0700) || chdir(p) || mkdir("b", 0700) || (f = fopen("b/f", "w")) == NULL || fclose(f))
+    return 99;
+  if(chdir(path))
+    return 99;
+
+  dir_ui = 0;
+  dir_mem_init(NULL);
+  dir_scan_init_roots(paths, 2);
+  if(dir_process() || !(root = dirlist_par)) {
+    fprintf(stderr, "scan failed: %s\n", dir_fatalerr ? dir_fatalerr : "no tree");
+    return 1;
+  }
+
+  snprintf(p, sizeof(p), "%s/x/a", path);
+  if(!(root->flags & FF_VROOT) || !sub(root, p)) {
+    fprintf(stderr, "%s not found\n", p);
+    return 1;
+  }
+  snprintf(p, sizeof(p), "%s/y/b", path);
+  if(!(root = sub(root, p)) || !sub(root, "f")) {
+    fprintf(stderr, "%s/f not found\n", p);
+    return 1;
+  }
+  return 0;
+}
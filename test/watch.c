@@ -0,0 +1,166 @@
+/* ncdu - NCurses Disk Usage
+
+  Copyright (c) 2007-2020 Yoran Heling
+
+  Permission is hereby granted, free of charge, to any person obtaining
+  a copy of this software and associated documentation files (the
+  "Software"), to deal in the Software without restriction, including
+  without limitation the rights to use, copy, modify, merge, publish,
+  distribute, sublicense, and/or sell copies of the Software, and to
+  permit persons to whom the Software is furnished to do so, subject to
+  the following conditions:
+
+  The above copyright notice and this permission notice shall be included
+  in all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+  EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+  MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+  CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+  TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+  SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+/* Removes a directory and its parent in the same poll, while the browser shows
+ * the directory. The browser should end up at the top directory, without
+ * looking at the removed directories (build with -fsanitize=address to catch
+ * that).
+ *
+ * Then creates more files than the inotify queue holds, after which the tree
+ * should be marked as stale. */
+
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libgen.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/capability.h>
+#endif
+
+static char path[64];
+
+static void cleanup(void) {
+  char cmd[80];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", path);
+  system(cmd);
+}
+
+static struct dir *sub(struct dir *d, const char *name) {
+  for(d=d->sub; d; d=d->next)
+    if(strcmp(d->name, name) == 0)
+      return d;
+  return NULL;
+}
+
+/* fanotify, which root gets, doesn't report entries of directories that have
+ * been removed by the time they are read. Drop the capability it needs to
+ * test the inotify events for each directory. */
+static void no_fanotify(void) {
+#if defined(__linux__) && defined(SYS_capget)
+  struct __user_cap_header_struct h = { _LINUX_CAPABILITY_VERSION_3, 0 };
+  struct __user_cap_data_struct c[2];
+  if(syscall(SYS_capget, &h, c))
+    return;
+  c[CAP_SYS_ADMIN/32].effective &= ~(1u << (CAP_SYS_ADMIN%32));
+  syscall(SYS_capset, &h, c);
+#endif
+}
+
+#if USE_WATCH
+
+static int remove_parent(void) {
+  struct dir *root, *d;
+  char p[96];
+
+  snprintf(p, sizeof(p), "%s/a", path);
+  if(mkdir(p, 0700))
+    return 99;
+  strcat(p, "/b");
+  if(mkdir(p, 0700))
+    return 99;
+  strcat(p, "/c");
+  if(mkdir(p, 0700))
+    return 99;
+
+  dir_ui = 0;
+  dir_mem_init(NULL);
+  dir_scan_init(path);
+  if(dir_process() || !(root = dirlist_par))
+    return 99;
+  if(!watch_active)
+    return 77;
+  if(!(d = sub(root, "a")) || !(d = sub(d, "b")))
+    return 99;
+  dirlist_open(d);
+
+  /* c, b and a, deepest first as with rm -r */
+  if(rmdir(p) || rmdir(dirname(p)) || rmdir(dirname(p)))
+    return 99;
+  usleep(100*1000);
+  watch_poll();
+
+  if(dirlist_par != root || root->sub || root->items) {
+    fprintf(stderr, "expected an empty %s, got %s with %d items\n", path, getpath(dirlist_par), dirlist_par->items);
+    return 1;
+  }
+  return 0;
+}
+
+
+static int overflow(void) {
+  FILE *f;
+  char p[96];
+  int i, n = 0;
+
+  if((f = fopen("/proc/sys/fs/inotify/max_queued_events", "r")) == NULL || fscanf(f, "%d", &n) != 1 || n > 100000) {
+    if(f)
+      fclose(f);
+    return 0;
+  }
+  fclose(f);
+  if(watch_stale) {
+    fprintf(stderr, "stale before any changes\n");
+    return 1;
+  }
+
+  for(i=0; i<=n; i++) {
+    snprintf(p, sizeof(p), "%s/%d", path, i);
+    if((f = fopen(p, "w")) == NULL)
+      return 99;
+    fclose(f);
+  }
+  watch_poll();
+
+  if(!watch_stale) {
+    fprintf(stderr, "not stale after %d new files\n", n+1);
+    return 1;
+  }
+  return 0;
+}
+
+#endif
+
+
+int main(void) {
+#if USE_WATCH
+  int r;
+
+  no_fanotify();
+  strcpy(path, "/tmp/ncdu-watch-XXXXXX");
+  if(!mkdtemp(path))
+    return 99;
+  atexit(cleanup);
+  watch_enabled = 1;
+
+  if((r = remove_parent()) != 0)
+    return r;
+  return overflow();
+#else
+  return 77;
+#endif
+}